@@ -0,0 +1,68 @@
+/* Compare the zero_scan implementations the CPU supports on buffers of
+   zeros of several sizes, the case sparse copies spend their time on.
+   Usage: bench_zero_scan [MiB scanned per size]  */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+
+#include "zero-scan.h"
+
+#define MAX_BLOCK (8 * 1024 * 1024)
+
+static size_t block_sizes[] = { 512, 4096, 64 * 1024, 1024 * 1024, MAX_BLOCK };
+
+double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+    size_t total = (argc > 1 ? strtoul(argv[1], NULL, 10) : 4096) << 20;
+    char *buf = aligned_alloc(4096, MAX_BLOCK);
+    if (!buf || !total) {
+        fprintf(stderr, "usage: %s [MiB scanned per size]\n", argv[0]);
+        return 1;
+    }
+    memset(buf, 0, MAX_BLOCK);
+    printf("zero_scan picks %s\n", zero_scan_name());
+
+    for (const struct zero_scan_impl *impl = zero_scan_impls; impl->name; impl++) {
+        if (!impl->supported()) {
+            printf("%-8s not supported\n", impl->name);
+            continue;
+        }
+        printf("%-8s", impl->name);
+        for (size_t i = 0; i < sizeof block_sizes / sizeof *block_sizes; i++) {
+            size_t size = block_sizes[i];
+
+            // a single nonzero byte anywhere must be found
+            buf[size - 1] = 1;
+            bool found = !impl->scan(buf, size);
+            buf[size - 1] = 0;
+            if (!found || !impl->scan(buf, size)) {
+                printf("\n%s: wrong result on %zu bytes\n", impl->name, size);
+                return 1;
+            }
+
+            size_t rounds = total / size;
+            size_t zero = 0;
+            double start = now();
+            for (size_t r = 0; r < rounds; r++)
+                zero += impl->scan(buf, size);
+            double secs = now() - start;
+            if (zero != rounds)
+                return 1;
+            printf("  %7zu B %6.2f GB/s", size, (double)rounds * size / secs / 1e9);
+        }
+        printf("\n");
+    }
+    free(buf);
+    return 0;
+}
@@ -21,9 +21,13 @@
 #include <assert.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <pthread.h>
 #include <selinux/selinux.h>
 #include <liburing.h>
 #include <math.h>
+#include <time.h>
 #include <string.h>
 
 #if HAVE_HURD_H
@@ -56,6 +60,7 @@
 #include "ignore-value.h"
 #include "ioblksize.h"
 #include "quote.h"
+#include "quotearg.h"
 #include "renameatu.h"
 #include "root-uid.h"
 #include "same.h"
@@ -68,6 +73,8 @@
 #include "areadlink.h"
 #include "yesno.h"
 #include "selinux.h"
+#include "tree-walk.h"
+#include "zero-scan.h"
 
 #if USE_XATTR
 # include <attr/error_context.h>
@@ -89,6 +96,30 @@
 # define FICLONE _IOW (0x94, 9, int)
 #endif
 
+#if !defined FICLONERANGE && defined __linux__
+struct file_clone_range
+{
+  int64_t src_fd;
+  uint64_t src_offset;
+  uint64_t src_length;
+  uint64_t dest_offset;
+};
+# define FICLONERANGE _IOW (0x94, 13, struct file_clone_range)
+#endif
+
+#if !defined FS_IOC_FIEMAP && defined __linux__
+# define FS_IOC_FIEMAP _IOWR ('f', 11, struct fiemap)
+#endif
+
+/* Used by IORING_OP_FALLOCATE even where fallocate(2) is not.  */
+#ifndef FALLOC_FL_KEEP_SIZE
+# define FALLOC_FL_KEEP_SIZE 0x01
+#endif
+#ifndef FALLOC_FL_PUNCH_HOLE
+# define FALLOC_FL_PUNCH_HOLE 0x02
+#endif
+#define AIO_FALLOC_PUNCH (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE)
+
 #ifndef HAVE_FCHOWN
 # define HAVE_FCHOWN false
 # define fchown(fd, uid, gid) (-1)
@@ -135,17 +166,44 @@ struct dir_list
 #define DEST_INFO_INITIAL_CAPACITY 61
 
 /* AIO configurations */
-#define AIO_BLKSIZE (10 * 1024 * 1024)    // I/O block size
-#define QD 1024                       // I/O queue depth
+#define AIO_BLKSIZE URING_BUFFER_SIZE     // maximum I/O block size (size of each AIO buffer)
+#define AIO_MIN_BLKSIZE (64 * 1024)       // minimum I/O block size chosen by the tuner
+#define AIO_INIT_BLKSIZE (1024 * 1024)    // initial I/O block size for large transfers
+#define AIO_TUNE_WINDOW 64                // completed chunks per tuning window
+#define AIO_TUNE_MAX_LATENCY 0.25         // chunk latency (seconds) above which blocks shrink
+#define QD 1024                       // I/O queue depth (and maximum number of AIO buffers)
+#define AIO_BUF_MEMORY (1024 * 1024 * 1024)   // default memory budget for AIO buffers
+#define AIO_HUGEPAGE_SIZE (2 * 1024 * 1024)   // transparent hugepage alignment
+#define AIO_REAP_BATCH 32                 // CQEs reaped per batch (and waited for, if available)
 
 struct aio_data {
-    int src_fd;
+    int src_fd;                     // descriptor, or fixed-file slot if fixed_file
     int dst_fd;
+    bool fixed_file;                // src_fd and dst_fd are fixed-file slots
+    struct aio_file *file;          // file copied through the ring, or NULL
     off_t offset;
-    int buf_index;
+    size_t len;                     // length of the request
+    int buf_index;                  // -1 until a provided buffer is picked
+    size_t buf_off;                 // offset of the slab object in the buffer
+    size_t seg_off;                 // offset of the current write in the object
     bool is_read;
     char *src_name;
     char *dst_name;
+    double submit_time;             // time the read of this chunk was prepared
+    struct aio_data *next;          // link in the list of reads waiting for a buffer
+
+    // zero detection (see aio_next_seg)
+    size_t hole_size;               // skip zero blocks of this size, 0 not to
+    bool punch_holes;               // punch zero blocks out instead of skipping them
+    int falloc_mode;                // fallocate mode of the current request, -1 to write
+    off_t data_end;                 // end of the data read
+
+    // state of a linked read->write chain (see aio_prep_link)
+    bool linked;                    // read and write were submitted as one chain
+    bool read_done;                 // CQE of the read half has been reaped
+    bool write_done;                // CQE of the write half has been reaped
+    int read_res;                   // result of the read half
+    int write_res;                  // result of the write half
 
     // pointers used for multi-file concurrent cp
     int *cnt;                       // count of inflight I/O for (src, dst) pair
@@ -153,41 +211,430 @@ struct aio_data {
     bool *io_error;                 // whether error is encountered for (src, dst) pair
 };
 
-struct io_uring aio_ring;
-int inflight = 0;
+/* Files copied through the ring end to end
+   A plain copy of a new regular file runs as a state machine driven by
+   its CQEs: the source is opened (IORING_OP_OPENAT) and stat'ed
+   (IORING_OP_STATX) at once, then the destination is opened, the chunks
+   go through the usual read/write path, and both files are closed with
+   IORING_OP_CLOSE.  copy_internal only queues the first step, so many
+   files sit in different phases at once.  Files are opened straight
+   into the fixed-file table when it has room.
+
+   A file of at most AIO_SMALL_FILE bytes opened into fixed slots is
+   copied by a single linked chain instead: open source, statx, create
+   destination, read, write, close destination, close source.  The read
+   asks for the size stat'ed by copy_internal, so a file that shrank
+   since breaks the chain with a short read, and one that grew, as the
+   statx tells once the chain has completed, has the rest copied by a
+   range job.  Requests after a failed one are cancelled, closes
+   included, so closes of files left open are queued again once the
+   chain has completed.  The chain is only queued when the SQ ring and
+   the ring depth have room for all of it.  */
+#define AIO_SMALL_FILE IO_BUFSIZE
+enum aio_file_op_kind
+{
+  AIO_FILE_OPEN_SRC,
+  AIO_FILE_STATX,
+  AIO_FILE_OPEN_DST,
+  AIO_FILE_READ,
+  AIO_FILE_WRITE,
+  AIO_FILE_CLOSE_SRC,
+  AIO_FILE_CLOSE_DST,
+  AIO_FILE_NOPS
+};
+
+struct aio_file;
+struct aio_file_op {
+    struct aio_file *file;
+    enum aio_file_op_kind kind;
+};
+
+struct aio_file {
+    struct aio_file_op op[AIO_FILE_NOPS];   // user data of file-level requests
+    int pending;                    // file-level requests in flight
+    char *src_name;
+    char *dst_name;
+    int src_flags;                  // flags to open the source with
+    int stat_flags;                 // flags to stat the source with
+    mode_t dst_mode;                // mode to create the destination with
+    bool range;                     // copy [offset, size) into an existing destination
+    bool counted;                   // counted in aio_file_opening
+    bool closing;                   // closes of the files are queued
+    dev_t src_dev;                  // identity of the source stat'ed by copy_internal
+    ino_t src_ino;
+    struct statx stx;               // result of IORING_OP_STATX
+    bool fixed;                     // src and dst are fixed-file slots
+    bool fds_held;                  // else two descriptors of the budget are taken
+    int src_slot;                   // slots reserved for the files, if fixed
+    int dst_slot;
+    int src;                        // descriptor or slot, -1 unless open
+    int dst;
+    off_t size;                     // bytes to copy
+    off_t offset;                   // offset of the next chunk
+    size_t buf_size;                // I/O unit for aio_chunk_size
+    bool small;                     // copied by one linked chain
+    struct aio_data chunk;          // buffer of the chain's read and write
+    struct aio_file *next;          // link in aio_file_parked list
+    off_t sched_len;                // bytes of data to copy
+    double sched_time;              // when the data phase started
+
+    // per-file state shared with the chunks, as in copy_reg
+    int cnt;
+    bool all_read_submit;
+    bool io_error;
+};
+
+__thread struct io_uring aio_ring;
+__thread int inflight = 0;
+__thread int aio_depth = QD;                 // ring depth: bound on inflight requests
+
+/* Linked read->write chains
+   With aio_link, each chunk is submitted as a read linked to its write
+   via IOSQE_IO_LINK.  The read half carries AIO_LINK_READ_TAG in its
+   user data so its CQE can be told apart from the write's.  When the
+   kernel supports IOSQE_CQE_SKIP_SUCCESS (aio_skip_success) successful
+   reads post no CQE at all, so a chunk normally costs one CQE.  */
+#define AIO_LINK_READ_TAG ((uintptr_t) 1)
+#define AIO_FILE_TAG ((uintptr_t) 2)        // user data is a struct aio_file_op
+#ifndef IOSQE_CQE_SKIP_SUCCESS
+# define IOSQE_CQE_SKIP_SUCCESS 0
+# define IORING_FEAT_CQE_SKIP 0
+#endif
+__thread bool aio_link = false;
+__thread bool aio_skip_success = false;
+
+/* SQ polling
+   With --uring-sqpoll a kernel thread (optionally pinned to one CPU)
+   polls the submission queue, so submitting does not take a syscall
+   unless the thread went idle and asked for a wakeup.  aio_reap only
+   enters the kernel to wait when too few completions are posted.  */
+__thread bool aio_sqpoll = false;
+
+/* Number of files whose destination is not created (or failed) yet */
+int aio_file_opening = 0;
+
+/* Chunk scheduler
+   Files in their data phase wait in the aio_file_parked list for ring
+   space and buffers, and aio_file_pump prepares their chunks one at a
+   time in the order of --uring-sched: with fifo all chunks of the head
+   file go first, with rr the head file goes to the tail after each
+   chunk, and with srf the list is kept sorted by bytes left to prepare,
+   which only ever shrinks for the head file.  Files of at most
+   AIO_SCHED_SMALL bytes are accounted apart in the statistics.  */
+#define AIO_SCHED_SMALL (1024 * 1024)
+__thread enum Uring_sched aio_sched = URING_SCHED_RR;
+__thread struct aio_file *aio_file_parked_head = NULL;
+__thread struct aio_file *aio_file_parked_tail = NULL;
+const char *aio_sched_name[] = {"fifo", "rr", "srf"};
+
+/* Set if a request failed after its file was handed to the ring */
+bool aio_failed = false;
+
+/* Worker engines
+   With --threads=N, N worker threads each run an engine of their own:
+   a ring, buffers and fixed-file table.  copy_internal still walks the
+   tree on the calling thread, but hands every file aio_file_start takes
+   to a worker, round robin, through per-worker deques.  A worker
+   takes files from the tail of its own deque and, when that is empty,
+   steals from the head of the others.  Once a large file's destination
+   is created, the worker copies its first AIO_SPLIT_SIZE bytes itself
+   and queues the rest as range jobs, so several workers share one big
+   file.  At most aio_pool_limit files are handed out but not finished.
+   The workers live for one copy: aio_pool_start waits for them to set
+   up their engines, numbering the deques among those that did, and
+   aio_pool_stop joins them.  A worker whose engine cannot be set up
+   exits at once and leaves its share of the files to the others.
+   aio_pool_lock guards the counters below and aio_file_opening.  */
+#define AIO_POOL_AHEAD 1024                   // files handed out per worker
+#define AIO_SPLIT_SIZE (64 * 1024 * 1024)     // size of a range job
+
+struct aio_deque {
+    pthread_mutex_t lock;
+    struct aio_file **file;         // ring buffer of SIZE entries
+    size_t size;                    // a power of two
+    size_t head, tail;              // take from head, push and pop at tail
+};
+
+pthread_mutex_t aio_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t aio_pool_wake = PTHREAD_COND_INITIALIZER;   // files were queued
+pthread_cond_t aio_pool_idle = PTHREAD_COND_INITIALIZER;   // files or workers settled
+int aio_nworkers = 0;                         // 0 if files stay on this thread
+struct aio_deque *aio_deques = NULL;
+size_t aio_pool_queued = 0;                   // files in the deques
+size_t aio_pool_pending = 0;                  // files handed out, not finished
+size_t aio_pool_limit = 0;
+int aio_pool_idle_workers = 0;
+unsigned aio_pool_next = 0;                   // worker the next file goes to
+pthread_t *aio_pool_threads = NULL;           // threads started, running or not
+int aio_pool_nthreads = 0;
+int aio_pool_size = 0;                        // deques allocated
+int aio_pool_reported = 0;                    // workers done setting up
+bool aio_pool_stopping = false;               // tells idle workers to exit
+const struct cp_options *aio_pool_options = NULL;
+__thread int aio_self = -1;                   // index of this worker
+__thread struct aio_file *aio_file_admitting = NULL;  // taken, waiting for descriptors
+
+/* Descriptor budget
+   Files in flight that are not in a fixed-file table hold two process
+   descriptors until their last request completes.  Every engine takes
+   them out of one budget, RLIMIT_NOFILE less AIO_FD_RESERVE and two per
+   directory walker, before it opens a pair, and waits for other files
+   to close when the budget is used up.  When nothing holds descriptors
+   a pair is always admitted, so a tiny limit slows the copy down
+   instead of stopping it.  Guarded by aio_pool_lock.  */
+#define AIO_FD_RESERVE 64
+int aio_fd_budget = 0;                        // 0 until aio_fd_init
+int aio_fd_used = 0;
+pthread_cond_t aio_fd_freed = PTHREAD_COND_INITIALIZER;
+
+/* Fixed-file table
+   Source and destination files are installed in a sparse fixed-file
+   table registered with the ring, and chunk SQEs address them by slot
+   with IOSQE_FIXED_FILE, which spares the kernel an fget/fput per
+   request.  The table holds its own reference to each file, so copy_reg
+   closes the regular descriptors as soon as it is done with them, and
+   files in flight do not take up the process fd table (RLIMIT_NOFILE).
+   While copy_reg runs, aio_file_slot maps its descriptors to slots.  */
+__thread bool aio_fixed_files = false;
+__thread int *aio_file_free = NULL;          // stack of free slots
+__thread int aio_file_nfree = 0;
+__thread int *aio_file_slot = NULL;          // descriptor -> slot, or -1
+__thread int aio_file_nfd = 0;               // size of aio_file_slot
+
+/* AIO statistics, printed with --uring-stats */
+struct aio_stats {
+    unsigned long long enters;      // calls submitting to or waiting on the ring
+    unsigned long long avoided;     // submits and reaps done without a syscall
+    unsigned long long wakeups;     // syscalls waking the idle SQ thread
+    unsigned long long sqes;        // SQEs submitted
+    unsigned long long cqes;        // CQEs reaped
+    unsigned long long batches;     // CQE batches reaped
+    unsigned long long files;       // files copied through the ring end to end
+    unsigned long long small_files; // of which by one linked chain
+    unsigned long long fd_waits;    // waits for descriptors of the budget
+    unsigned long long steals;      // files and ranges taken from another worker
+    unsigned long long clones;      // extents cloned by clone_copy
+    unsigned long long clone_copies;  // and copied through the ring instead
+    unsigned long long range_files; // files copied by copy_file_range threads
+    unsigned long long sched_small; // small and large files scheduled, and the
+    unsigned long long sched_large; // total and worst time to copy their data
+    double sched_small_time, sched_small_max;
+    double sched_large_time, sched_large_max;
+    unsigned long long engines;     // engines whose buffers are counted below
+    unsigned long long buffers;     // AIO buffers allocated
+    unsigned long long buffer_max;  // and the most that could be
+    unsigned long long registration[3];  // engines by aio_buf_reg_name
+    unsigned long long backing[4];  // engines by aio_arena_name
+};
+static char const *const aio_buf_reg_name[] = { "no", "sparse", "up-front" };
+__thread struct aio_stats aio_stats;
+struct aio_stats aio_stats_total;   // merged from all engines, under aio_pool_lock
+__thread bool aio_print_stats = false;
+bool pio_engine = false;            // no ring could be set up: see pio_copy
+int pio_errno;                      // what set-up failed with
+size_t pio_threads;                 // pool threads, besides the copying one
+unsigned long long pio_reads, pio_writes;   // chunks, counted under pio_lock
+
+/* Adaptive I/O block size
+   AIO_BLKSIZE only bounds the size of a single request; the block size
+   actually used for large transfers is the blksize of a tuner, tuned at
+   runtime by hill climbing on the throughput observed over windows of
+   AIO_TUNE_WINDOW completed chunks.  The tuner keeps doubling (or
+   halving) while throughput improves and reverses direction otherwise.
+   It always shrinks when chunks take longer than AIO_TUNE_MAX_LATENCY
+   to complete, so one slow device does not hold huge buffers.  Each
+   engine has its own tuner; the thread pool shares pio_tuner.  */
+struct aio_tuner {
+    size_t blksize;             // block size for large transfers
+    int dir;                    // 1: grow block size, -1: shrink it
+    int cnt;                    // chunks completed in current window
+    off_t bytes;                // bytes completed in current window
+    double latency;             // sum of chunk latencies in current window
+    double start;               // start time of current window
+    double bw;                  // throughput of previous window
+};
+#define AIO_TUNER_INIT { AIO_INIT_BLKSIZE, 1, 0, 0, 0, 0, 0 }
+__thread struct aio_tuner aio_tuner = AIO_TUNER_INIT;
+
+/* AIO buffer queue
+   The pool starts empty and grows by one AIO_BLKSIZE buffer whenever the
+   queue runs dry, until aio_buf_max buffers (the memory budget) exist.
+   New buffers are not touched before their first I/O, and are added to
+   a sparse registered buffer table (aio_buf_sparse) one at a time.  On
+   kernels without sparse buffer registration the whole budget is
+   allocated and registered up front instead.  Registered buffers are
+   pinned and charged to RLIMIT_MEMLOCK; where not even one fits, or
+   registering the first one fails, the buffers are used unregistered
+   (aio_buf_fixed is false), with plain reads and writes.  */
+__thread int aio_buf_queue[QD];
+__thread struct iovec aio_buf[QD];
+__thread int aio_buf_qhead, aio_buf_qtail;
+__thread int aio_buf_count = 0;              // number of allocated buffers
+__thread int aio_buf_max = QD;               // number of buffers the budget allows
+__thread bool aio_buf_sparse = false;        // buffers are registered as they are allocated
+__thread bool aio_buf_fixed = true;          // buffers are registered at all
+
+/* AIO buffer arena
+   Buffers are carved out of one mapping sized to the memory budget, so
+   that registering them pins hugepages instead of 4 KiB pages.  Try
+   MAP_HUGETLB first (reserving the hugepages up front, so faults cannot
+   fail later), then an anonymous mapping with MADV_HUGEPAGE, and as a
+   last resort allocate each buffer on its own.  Pages are only faulted
+   in when a buffer is first used.  */
+enum aio_arena_backing
+{
+  AIO_ARENA_MALLOC,                 // no arena: one posix_memalign per buffer
+  AIO_ARENA_HUGETLB,                // explicit hugepages (MAP_HUGETLB)
+  AIO_ARENA_THP,                    // transparent hugepages (MADV_HUGEPAGE)
+  AIO_ARENA_PAGES                   // anonymous mapping of regular pages
+};
+static char const *const aio_arena_name[] =
+{
+  "malloc", "hugetlb", "transparent hugepages", "regular pages"
+};
+__thread enum aio_arena_backing aio_arena_backing = AIO_ARENA_MALLOC;
+__thread char *aio_arena = NULL;             // start of the buffers, aligned
+__thread void *aio_arena_map = NULL;         // start of the mapping
+__thread size_t aio_arena_map_size = 0;
+
+void aio_arena_init(size_t size)
+{
+    aio_arena_backing = AIO_ARENA_MALLOC;
+    aio_arena = NULL;
+
+#ifdef MAP_HUGETLB
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p != MAP_FAILED)
+    {
+        aio_arena_map = p;
+        aio_arena_map_size = size;
+        aio_arena = p;
+        aio_arena_backing = AIO_ARENA_HUGETLB;
+        return;
+    }
+#endif
+
+    // over-allocate so the arena can start on a hugepage boundary
+    size_t map_size = size + AIO_HUGEPAGE_SIZE;
+    void *q = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (q == MAP_FAILED) return;
+    aio_arena_map = q;
+    aio_arena_map_size = map_size;
+    aio_arena = (char *)(((uintptr_t)q + AIO_HUGEPAGE_SIZE - 1)
+                         & ~((uintptr_t)AIO_HUGEPAGE_SIZE - 1));
+    aio_arena_backing = AIO_ARENA_PAGES;
+#ifdef MADV_HUGEPAGE
+    if (madvise(aio_arena, size, MADV_HUGEPAGE) == 0)
+        aio_arena_backing = AIO_ARENA_THP;
+#endif
+}
 
-/* AIO buffer queue */
-int aio_buf_queue[QD];
-struct iovec aio_buf[QD];
-int aio_buf_qhead, aio_buf_qtail;
+void aio_arena_destroy()
+{
+    if (aio_arena_map)
+        munmap(aio_arena_map, aio_arena_map_size);
+    aio_arena_map = NULL;
+    aio_arena = NULL;
+}
 
-int aio_buf_queue_init() {
+int aio_buf_queue_init(uintmax_t budget, int share) {
     aio_buf_qhead = 0;
     aio_buf_qtail = QD - 1;
     for (int i = 0; i < QD; i++)
     {
-        // allocate AIO buffer
         aio_buf[i].iov_base = NULL;
-        // aio_buf[i].iov_base = malloc(AIO_BLKSIZE);
-        posix_memalign((void **)&aio_buf[i].iov_base, getpagesize(), AIO_BLKSIZE);
-        if (aio_buf[i].iov_base == NULL)
+        aio_buf[i].iov_len = AIO_BLKSIZE;
+        aio_buf_queue[i] = -1;
+    }
+
+    // stay within RLIMIT_MEMLOCK, which registered buffers are charged to,
+    // unless it leaves no buffer to register
+    struct rlimit rlim;
+    aio_buf_fixed = true;
+    if (budget == 0)
+    {
+        budget = AIO_BUF_MEMORY;
+        if (getrlimit(RLIMIT_MEMLOCK, &rlim) == 0 && rlim.rlim_cur != RLIM_INFINITY
+            && rlim.rlim_cur < budget)
         {
-            fprintf(stderr, "error allocating AIO buffer\n");
-            return -1;
+            if (rlim.rlim_cur / share < AIO_BLKSIZE)
+                aio_buf_fixed = false;
+            else
+                budget = rlim.rlim_cur;
         }
-        aio_buf[i].iov_len = AIO_BLKSIZE;
-        memset(aio_buf[i].iov_base, 0, AIO_BLKSIZE);
+    }
+    budget /= share;                // split among the engines
+    aio_buf_count = 0;
+    aio_buf_max = MAX(1, MIN(QD, budget / AIO_BLKSIZE));
+    aio_arena_init((size_t)aio_buf_max * AIO_BLKSIZE);
+    return 0;
+}
 
-        // initialize buffer queue
-        aio_buf_queue[i] = i;
+int aio_buf_alloc(int i)
+{
+    // allocate AIO buffer; its pages are faulted in by the first I/O
+    aio_buf[i].iov_len = AIO_BLKSIZE;
+    if (aio_arena)
+    {
+        aio_buf[i].iov_base = aio_arena + (size_t)i * AIO_BLKSIZE;
+        return 0;
+    }
+    posix_memalign((void **)&aio_buf[i].iov_base, getpagesize(), AIO_BLKSIZE);
+    if (aio_buf[i].iov_base == NULL)
+    {
+        fprintf(stderr, "error allocating AIO buffer\n");
+        return -1;
     }
     return 0;
 }
 
-void aio_buf_queue_destroy()
+void aio_buf_free(int i)
 {
-    for (int i = 0; i < QD; i++)
+    if (!aio_arena)
         free(aio_buf[i].iov_base);
+    aio_buf[i].iov_base = NULL;
+}
+
+/* Register the AIO buffers with RING: an empty sparse table if the
+   kernel supports it, otherwise every buffer of the budget.  */
+int aio_buf_register(struct io_uring *ring)
+{
+    aio_buf_sparse = false;
+    if (!aio_buf_fixed) return 0;
+
+    int ret = io_uring_register_buffers_sparse(ring, aio_buf_max);
+    if (ret == 0)
+    {
+        aio_buf_sparse = true;
+        return 0;
+    }
+
+    aio_buf_sparse = false;
+    for (; aio_buf_count < aio_buf_max; aio_buf_count++)
+    {
+        if (aio_buf_alloc(aio_buf_count) < 0) return -1;
+        aio_buf_queue[aio_buf_count] = aio_buf_count;
+    }
+    aio_buf_qtail = aio_buf_max - 1;
+
+    ret = io_uring_register_buffers(ring, aio_buf, aio_buf_max);
+    if (ret < 0)
+    {
+        fprintf(stderr, "warning: cannot register AIO buffers, using them "
+                "unregistered: %s\n", strerror(-ret));
+        aio_buf_fixed = false;
+    }
+    return 0;
+}
+
+void aio_buf_queue_destroy()
+{
+    for (int i = 0; i < aio_buf_count; i++)
+        aio_buf_free(i);
+    aio_buf_count = 0;
+    aio_arena_destroy();
 }
 
 int aio_buf_enqueue(int buf_index)
@@ -212,13 +659,386 @@ int aio_buf_dequeue()
     return buf_index;
 }
 
+/* AIO provided buffer ring
+   With --uring-buffers=ring the registered AIO buffers are also handed
+   to the kernel through a provided buffer ring of group AIO_BUF_GROUP.
+   Reads are submitted without a buffer and the kernel picks one; its
+   index comes back in the CQE flags, and the write reuses it as a fixed
+   buffer.  A buffer goes back to the ring once its write completes.
+   Reads failing with -ENOBUFS wait on aio_nobuf_head until then.  */
+#define AIO_BUF_GROUP 0
+__thread enum Uring_buffers aio_buf_mode = URING_BUFFERS_QUEUE;
+__thread struct io_uring_buf_ring *aio_buf_ring = NULL;
+__thread struct aio_data *aio_nobuf_head = NULL;
+__thread struct aio_data *aio_nobuf_tail = NULL;
+
+int aio_buf_ring_init(struct io_uring *ring)
+{
+    struct io_uring_buf_reg reg;
+    size_t ring_size = QD * sizeof(struct io_uring_buf);
+
+    posix_memalign((void **)&aio_buf_ring, getpagesize(), ring_size);
+    if (aio_buf_ring == NULL)
+    {
+        fprintf(stderr, "error allocating AIO buffer ring\n");
+        return -1;
+    }
+    memset(aio_buf_ring, 0, ring_size);
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long)aio_buf_ring;
+    reg.ring_entries = QD;
+    reg.bgid = AIO_BUF_GROUP;
+    int ret = io_uring_register_buf_ring(ring, &reg, 0);
+    if (ret < 0)
+    {
+        fprintf(stderr, "Fail to register buffer ring: %s\n", strerror(-ret));
+        free(aio_buf_ring);
+        aio_buf_ring = NULL;
+        return -1;
+    }
+
+    io_uring_buf_ring_init(aio_buf_ring);
+    for (int i = 0; i < aio_buf_count; i++)
+        io_uring_buf_ring_add(aio_buf_ring, aio_buf[i].iov_base, AIO_BLKSIZE, i,
+                              io_uring_buf_ring_mask(QD), i);
+    io_uring_buf_ring_advance(aio_buf_ring, aio_buf_count);
+    return 0;
+}
+
+void aio_buf_ring_destroy(struct io_uring *ring)
+{
+    if (aio_buf_ring == NULL) return;
+    io_uring_unregister_buf_ring(ring, AIO_BUF_GROUP);
+    free(aio_buf_ring);
+    aio_buf_ring = NULL;
+}
+
+void aio_buf_ring_recycle(int buf_index)
+{
+    io_uring_buf_ring_add(aio_buf_ring, aio_buf[buf_index].iov_base, AIO_BLKSIZE,
+                          buf_index, io_uring_buf_ring_mask(QD), 0);
+    io_uring_buf_ring_advance(aio_buf_ring, 1);
+}
+
+/* Add one buffer to the pool, if the budget allows it.
+   Return 0 if a buffer was added to the queue (or the ring).  */
+int aio_buf_grow()
+{
+    int i = aio_buf_count;
+    if (i >= aio_buf_max || aio_buf_alloc(i) < 0) return -1;
+
+    int ret = aio_buf_fixed
+              ? io_uring_register_buffers_update_tag(&aio_ring, i, &aio_buf[i], NULL, 1)
+              : 0;
+    if (ret < 0 && i == 0)
+    {
+        // not even one buffer can be pinned: use them unregistered
+        fprintf(stderr, "warning: cannot register AIO buffers, using them "
+                "unregistered: %s\n", strerror(-ret));
+        aio_buf_fixed = false;
+    }
+    else if (ret < 0)
+    {
+        // e.g. RLIMIT_MEMLOCK reached: make do with the buffers we have
+        fprintf(stderr, "warning: cannot register more AIO buffers: %s\n", strerror(-ret));
+        aio_buf_free(i);
+        aio_buf_max = i;
+        return -1;
+    }
+    aio_buf_count++;
+
+    if (aio_buf_mode == URING_BUFFERS_RING)
+        aio_buf_ring_recycle(i);
+    else if (aio_buf_enqueue(i) < 0)
+        return -1;
+    return 0;
+}
+
+/* Take a buffer from the queue, growing the pool if it is empty.  */
+int aio_buf_take()
+{
+    int buf_index = aio_buf_dequeue();
+    if (buf_index < 0 && aio_buf_grow() == 0)
+        buf_index = aio_buf_dequeue();
+    return buf_index;
+}
+
+/* Set up a fixed-file table of up to NR slots for RING.
+   Leave aio_fixed_files false if the kernel does not support it.  */
+void aio_file_init(struct io_uring *ring, int nr)
+{
+    struct rlimit rlim;
+    int nfd = 1024;
+    if (getrlimit(RLIMIT_NOFILE, &rlim) == 0 && rlim.rlim_cur != RLIM_INFINITY)
+        nfd = MIN(rlim.rlim_cur, 1 << 20);
+
+    // the kernel caps the table at RLIMIT_NOFILE too
+    nr = MIN(nr, nfd);
+    aio_fixed_files = io_uring_register_files_sparse(ring, nr) == 0;
+    if (!aio_fixed_files) return;
+
+    aio_file_free = xnmalloc(nr, sizeof *aio_file_free);
+    for (int i = 0; i < nr; i++)
+        aio_file_free[i] = nr - 1 - i;
+    aio_file_nfree = nr;
+
+    aio_file_slot = xnmalloc(nfd, sizeof *aio_file_slot);
+    for (int i = 0; i < nfd; i++)
+        aio_file_slot[i] = -1;
+    aio_file_nfd = nfd;
+}
+
+void aio_file_destroy()
+{
+    free(aio_file_free);
+    free(aio_file_slot);
+    aio_file_free = NULL;
+    aio_file_slot = NULL;
+    aio_file_nfree = aio_file_nfd = 0;
+    aio_fixed_files = false;
+}
+
+/* Install FD in a free slot.  Return the slot, or -1.  */
+static int aio_file_register(int fd)
+{
+    if (aio_file_nfree == 0) return -1;
+    int slot = aio_file_free[--aio_file_nfree];
+    if (io_uring_register_files_update(&aio_ring, slot, &fd, 1) != 1)
+    {
+        aio_file_free[aio_file_nfree++] = slot;
+        return -1;
+    }
+    return slot;
+}
+
+/* Remove the file in SLOT from the table, dropping its reference.  */
+void aio_file_unregister(int slot)
+{
+    int fd = -1;
+    io_uring_register_files_update(&aio_ring, slot, &fd, 1);
+    aio_file_free[aio_file_nfree++] = slot;
+}
+
+/* Install SRC_FD and DST_FD in the fixed-file table.
+   Return false, installing neither, if that is not possible.  */
+bool aio_file_register_pair(int src_fd, int dst_fd)
+{
+    if (!aio_fixed_files || aio_file_nfd <= src_fd || aio_file_nfd <= dst_fd)
+        return false;
+
+    int src_slot = aio_file_register(src_fd);
+    if (src_slot < 0) return false;
+    int dst_slot = aio_file_register(dst_fd);
+    if (dst_slot < 0)
+    {
+        aio_file_unregister(src_slot);
+        return false;
+    }
+    aio_file_slot[src_fd] = src_slot;
+    aio_file_slot[dst_fd] = dst_slot;
+    return true;
+}
+
+/* Forget the slots of SRC_FD and DST_FD, which copy_reg is about to
+   close.  Unless requests still use them (IN_USE), remove the files
+   from the table as well.  */
+void aio_file_release_pair(int src_fd, int dst_fd, bool in_use)
+{
+    if (!in_use)
+    {
+        aio_file_unregister(aio_file_slot[src_fd]);
+        aio_file_unregister(aio_file_slot[dst_fd]);
+    }
+    aio_file_slot[src_fd] = -1;
+    aio_file_slot[dst_fd] = -1;
+}
+
+/* Set *SRC_IO and *DST_IO to what requests on SRC_FD and DST_FD should
+   address.  Return true if those are fixed-file slots.  */
+bool aio_file_lookup(int src_fd, int dst_fd, int *src_io, int *dst_io)
+{
+    if (aio_fixed_files && src_fd < aio_file_nfd && dst_fd < aio_file_nfd
+        && aio_file_slot[src_fd] >= 0 && aio_file_slot[dst_fd] >= 0)
+    {
+        *src_io = aio_file_slot[src_fd];
+        *dst_io = aio_file_slot[dst_fd];
+        return true;
+    }
+    *src_io = src_fd;
+    *dst_io = dst_fd;
+    return false;
+}
+
+/* AIO buffer slabs
+   With --uring-buffers=slab (the default) each registered AIO buffer is
+   a slab, carved into objects of a single size class when first needed.
+   A chunk takes the smallest object that holds it and addresses it at
+   buf_off inside the registered buffer, so read_fixed/write_fixed still
+   work on the slab's buffer index.  Free slabs live in aio_buf_queue; a
+   slab whose objects are all free again returns there and may later
+   serve another class.  Small objects let far more chunks be inflight
+   than there are buffers, so the ring is AIO_SLAB_DEPTH deep.  */
+#define AIO_SLAB_CLASSES 8
+#define AIO_SLAB_MIN (4 * 1024)           // smallest size class
+#define AIO_SLAB_DEPTH 16384              // ring depth in slab mode
+const size_t aio_slab_size[AIO_SLAB_CLASSES] = {
+    AIO_SLAB_MIN, 16 * 1024, 64 * 1024, 256 * 1024,
+    1024 * 1024, 2 * 1024 * 1024, 5 * 1024 * 1024, AIO_BLKSIZE
+};
+
+struct aio_slab {
+    int cls;                        // size class, -1 while the slab is free
+    int nfree;                      // number of free objects
+    unsigned short *free_obj;       // stack of free object indices
+    int prev, next;                 // links in the partial list of the class
+};
+__thread struct aio_slab aio_slab[QD];
+__thread int aio_slab_partial[AIO_SLAB_CLASSES];   // slabs of each class with free objects
+
+void aio_slab_init()
+{
+    for (int c = 0; c < AIO_SLAB_CLASSES; c++)
+        aio_slab_partial[c] = -1;
+    for (int i = 0; i < QD; i++)
+    {
+        aio_slab[i].cls = -1;
+        aio_slab[i].nfree = 0;
+        aio_slab[i].free_obj = NULL;
+    }
+}
+
+void aio_slab_destroy()
+{
+    for (int i = 0; i < QD; i++)
+    {
+        free(aio_slab[i].free_obj);
+        aio_slab[i].free_obj = NULL;
+    }
+}
+
+static void aio_slab_link(int s)
+{
+    struct aio_slab *slab = &aio_slab[s];
+    slab->prev = -1;
+    slab->next = aio_slab_partial[slab->cls];
+    if (slab->next >= 0) aio_slab[slab->next].prev = s;
+    aio_slab_partial[slab->cls] = s;
+}
+
+static void aio_slab_unlink(int s)
+{
+    struct aio_slab *slab = &aio_slab[s];
+    if (slab->prev >= 0) aio_slab[slab->prev].next = slab->next;
+    else aio_slab_partial[slab->cls] = slab->next;
+    if (slab->next >= 0) aio_slab[slab->next].prev = slab->prev;
+}
+
+/* Take an object of at least LEN bytes.  Return the index of its slab
+   and set *OFF to its offset, or return -1 if no slab is available.  */
+int aio_slab_alloc(size_t len, size_t *off)
+{
+    int c = 0;
+    while (aio_slab_size[c] < len) c++;
+
+    int s = aio_slab_partial[c];
+    if (s < 0)
+    {
+        s = aio_buf_take();
+        if (s < 0) return -1;
+
+        struct aio_slab *slab = &aio_slab[s];
+        int n = AIO_BLKSIZE / aio_slab_size[c];
+        if (slab->free_obj == NULL)
+            slab->free_obj = xnmalloc(AIO_BLKSIZE / AIO_SLAB_MIN, sizeof *slab->free_obj);
+        slab->cls = c;
+        slab->nfree = n;
+        for (int i = 0; i < n; i++)
+            slab->free_obj[i] = n - 1 - i;
+        aio_slab_link(s);
+    }
+
+    struct aio_slab *slab = &aio_slab[s];
+    *off = slab->free_obj[--slab->nfree] * aio_slab_size[c];
+    if (slab->nfree == 0) aio_slab_unlink(s);
+    return s;
+}
+
+/* Give back the object at OFF in slab S.  Return -1 if an emptied slab
+   could not be put back in the free slab queue.  */
+int aio_slab_free(int s, size_t off)
+{
+    struct aio_slab *slab = &aio_slab[s];
+    int c = slab->cls;
+    int n = AIO_BLKSIZE / aio_slab_size[c];
+
+    slab->free_obj[slab->nfree++] = off / aio_slab_size[c];
+    if (slab->nfree == 1) aio_slab_link(s);
+    if (slab->nfree < n) return 0;
+
+    aio_slab_unlink(s);
+    slab->cls = -1;
+    return aio_buf_enqueue(s);
+}
+
+#define AIO_BUF_ADDR(data) ((char *)aio_buf[(data)->buf_index].iov_base \
+                            + (data)->buf_off + (data)->seg_off)
+
 /* AIO utils */
+bool aio_engine_init(const struct cp_options *options, int share);
 void aio_exit(bool fatal_error);
+void aio_fail();
 void aio_free_data(struct aio_data *data);
+int aio_get_buf(struct aio_data *data);
+void aio_release_buf(struct aio_data *data);
+void aio_prep_buf_rw(struct io_uring_sqe *sqe, bool is_read, int fd, void *buf,
+                     unsigned len, off_t offset, int buf_index);
 void aio_prep_rw(struct aio_data *data);
-void aio_submit(int ready, int *cnt, char const *file_name, bool is_read);
-void aio_proc_cqe(struct io_uring_cqe *cqe, bool *write_comp);
+void aio_prep_link(struct aio_data *data);
+unsigned aio_sq_pending();
+bool aio_sqpoll_submit();
+void aio_submit();
+void aio_reap(unsigned wait_nr);
+unsigned aio_reap_nr();
+void aio_proc_cqe(struct io_uring_cqe *cqe);
+void aio_proc_link_cqe(struct io_uring_cqe *cqe, struct aio_data *data, bool is_read);
+void aio_read_done(struct aio_data *data);
+void aio_write_done(struct aio_data *data);
+bool aio_next_seg(struct aio_data *data);
+void aio_finish_link(struct aio_data *data);
 void aio_wait_all_comp();
+struct io_uring_sqe *aio_get_sqe();
+bool aio_file_start(char const *src_name, char const *dst_name,
+                    const struct cp_options *x, mode_t dst_mode,
+                    struct stat const *src_sb);
+void aio_file_proc_cqe(struct io_uring_cqe *cqe, struct aio_file_op *op);
+void aio_file_pump();
+void aio_file_settle();
+void aio_file_close(struct aio_file *file);
+void aio_file_finish(struct aio_file *file);
+bool aio_file_admit(struct aio_file *file);
+void aio_file_begin(struct aio_file *file);
+void aio_fd_init(const struct cp_options *options);
+bool aio_fd_take(int n);
+void aio_fd_release(int n);
+void aio_fd_wait(int n);
+void aio_pool_start(const struct cp_options *options);
+void aio_pool_push(struct aio_file *file, int target);
+struct aio_file *aio_pool_take();
+void aio_pool_submit(struct aio_file *file);
+void aio_pool_done();
+void aio_pool_quiesce();
+void aio_pool_stop();
+void aio_stats_engine();
+void aio_stats_merge();
+void aio_stats_print();
+double aio_now();
+size_t aio_chunk_size(struct aio_tuner const *tuner, size_t buf_size,
+                      uintmax_t max_n_read);
+void aio_tuner_update(struct aio_tuner *tuner, size_t len, double submit_time);
+void aio_tune(struct aio_data *data);
+static bool pio_init (struct cp_options const *options, int err);
+static void pio_exit (void);
 
 
 static bool copy_internal (char const *src_name, char const *dst_name,
@@ -339,260 +1159,2276 @@ create_hole (int fd, char const *name, bool punch_holes, off_t size)
    Otherwise destroy AIO buffer queue and exit AIO normally.  */
 void aio_exit(bool fatal_error)
 {
-  io_uring_queue_exit(&aio_ring);
+  if (pio_engine)
+    pio_exit();
+  else
+  {
+    aio_buf_ring_destroy(&aio_ring);
+    io_uring_queue_exit(&aio_ring);
+  }
   aio_buf_queue_destroy();
+  aio_slab_destroy();
+  aio_file_destroy();
 
   if (fatal_error) exit(1);
 }
 
-/* AIO utils: free AIO data and release buffer back to queue */
-void aio_free_data(struct aio_data *data)
+/* AIO utils: set up this thread's engine
+   Initialize the ring, deeper when small buffers can be carved out, and
+   the buffers and fixed-file table that go with it.  The buffer budget
+   is split among SHARE engines.  Return false on failure.  */
+bool aio_engine_init(const struct cp_options *options, int share)
+{
+  if (pio_engine)
+    return pio_init(options, 0);
+
+  aio_buf_mode = options->uring_buffers;
+  aio_depth = aio_buf_mode == URING_BUFFERS_SLAB ? AIO_SLAB_DEPTH : QD;
+  struct io_uring_params params;
+  memset(&params, 0, sizeof params);
+  if (options->uring_sqpoll)
+  {
+    params.flags |= IORING_SETUP_SQPOLL;
+    params.sq_thread_idle = options->uring_sqpoll_idle;
+    if (options->uring_sq_cpu >= 0)
+    {
+      params.flags |= IORING_SETUP_SQ_AFF;
+      params.sq_thread_cpu = options->uring_sq_cpu;
+    }
+  }
+  int ret = io_uring_queue_init_params(aio_depth, &aio_ring, &params);
+  if (ret < 0 && options->uring_sqpoll)
+  {
+    // e.g. unprivileged on an old kernel: fall back to plain submission
+    fprintf(stderr, "warning: cannot set up SQ polling: %s\n", strerror(-ret));
+    ret = io_uring_queue_init(aio_depth, &aio_ring, 0);
+  }
+  // e.g. io_uring_setup blocked by seccomp: copy on a thread pool instead
+  if (ret < 0 && aio_self < 0)
+    return pio_init(options, -ret);
+  if (ret < 0)
+  {
+    fprintf(stderr, "error initializing io_uring: %s\n", strerror(-ret));
+    return false;
+  }
+  aio_sqpoll = aio_ring.flags & IORING_SETUP_SQPOLL;
+  // a linked write needs its buffer before the read picks one
+  aio_link = options->uring_link && aio_buf_mode != URING_BUFFERS_RING;
+  aio_print_stats = options->uring_stats;
+  aio_skip_success = aio_ring.features & IORING_FEAT_CQE_SKIP;
+  aio_sched = options->uring_sched;
+
+  // initialize AIO buffer queue, empty until buffers are needed
+  ret = aio_buf_queue_init(options->buffer_memory, share);
+  if (ret < 0) return false;
+  aio_slab_init();
+
+  // register AIO buffer
+  ret = aio_buf_register(&aio_ring);
+  if (ret < 0)
+  {
+    aio_exit(false);
+    return false;
+  }
+
+  // install files in a fixed-file table, two slots per file in flight
+  aio_file_init(&aio_ring, 2 * aio_depth);
+
+  // provide the same buffers to the kernel for buffer selection
+  if (aio_buf_mode == URING_BUFFERS_RING && aio_buf_ring_init(&aio_ring) < 0)
+  {
+    aio_exit(false);
+    return false;
+  }
+  return true;
+}
+
+/* AIO utils: record that a request failed, from any engine */
+void aio_fail()
+{
+  __atomic_store_n(&aio_failed, true, __ATOMIC_RELAXED);
+}
+
+/* AIO utils: get a buffer for the read of DATA
+   Return -1 if none is available right now; in ring mode the kernel
+   picks the buffer later, when the read runs.  */
+int aio_get_buf(struct aio_data *data)
+{
+  data->buf_index = -1;
+  data->buf_off = 0;
+  data->seg_off = 0;
+  switch (aio_buf_mode)
+  {
+    case URING_BUFFERS_RING:
+      return 0;
+    case URING_BUFFERS_SLAB:
+      data->buf_index = aio_slab_alloc(data->len, &data->buf_off);
+      break;
+    default:
+      data->buf_index = aio_buf_take();
+      break;
+  }
+  return data->buf_index < 0 ? -1 : 0;
+}
+
+/* AIO utils: release the buffer of DATA back to the queue or ring
+   In ring mode this also restarts a read that ran out of buffers.  */
+void aio_release_buf(struct aio_data *data)
 {
-  if (aio_buf_enqueue(data->buf_index) < 0)
+  if (data->buf_index < 0) return;
+
+  if (aio_buf_mode == URING_BUFFERS_RING)
+  {
+    aio_buf_ring_recycle(data->buf_index);
+    data->buf_index = -1;
+
+    struct aio_data *waiting = aio_nobuf_head;
+    if (waiting)
+    {
+      aio_nobuf_head = waiting->next;
+      if (aio_nobuf_head == NULL) aio_nobuf_tail = NULL;
+      (*waiting->cnt)--;          // counted while waiting, aio_prep_rw counts it again
+      aio_prep_rw(waiting);
+    }
+    return;
+  }
+
+  if ((aio_buf_mode == URING_BUFFERS_SLAB
+       ? aio_slab_free(data->buf_index, data->buf_off)
+       : aio_buf_enqueue(data->buf_index)) < 0)
   {
     fprintf(stderr, "error releasing buffer back to AIO buffer queue\n");
     aio_exit(true);
   }
+  data->buf_index = -1;
+}
+
+/* AIO utils: free AIO data and release buffer back to queue */
+void aio_free_data(struct aio_data *data)
+{
+  aio_release_buf(data);
 
   // close file when all requests are done
-  if (*data->cnt == 0 && *data->all_read_submit)
+  if (*data->cnt == 0 && *data->all_read_submit && data->file)
+    aio_file_close(data->file);
+  else if (*data->cnt == 0 && *data->all_read_submit)
   {
     free(data->cnt);
     free(data->all_read_submit);
     free(data->io_error);
     free(data->src_name);
     free(data->dst_name);
-    close(data->src_fd);
-    close(data->dst_fd);
+    if (data->fixed_file)
+    {
+      aio_file_unregister(data->src_fd);
+      aio_file_unregister(data->dst_fd);
+    }
+    else
+    {
+      close(data->src_fd);
+      close(data->dst_fd);
+      aio_fd_release(2);
+    }
   }
 
   free(data);
 }
 
-/* AIO utils: prepare for read/write */
+/* AIO utils: prepare a read (or write, unless IS_READ) of LEN bytes at
+   OFFSET of FD into BUF, in AIO buffer BUF_INDEX */
+void aio_prep_buf_rw(struct io_uring_sqe *sqe, bool is_read, int fd, void *buf,
+                     unsigned len, off_t offset, int buf_index)
+{
+  if (!aio_buf_fixed && is_read)
+      io_uring_prep_read(sqe, fd, buf, len, offset);
+  else if (!aio_buf_fixed)
+      io_uring_prep_write(sqe, fd, buf, len, offset);
+  else if (is_read)
+      io_uring_prep_read_fixed(sqe, fd, buf, len, offset, buf_index);
+  else
+      io_uring_prep_write_fixed(sqe, fd, buf, len, offset, buf_index);
+}
+
+/* AIO utils: prepare for read/write
+   Prepared requests count as inflight right away; they are handed to
+   the kernel in bulk by the next aio_submit or aio_reap.  */
 void aio_prep_rw(struct aio_data *data)
 {
   struct io_uring_sqe *sqe = io_uring_get_sqe(&aio_ring);
-  if (data->is_read)
-      io_uring_prep_read_fixed(sqe, data->src_fd, aio_buf[data->buf_index].iov_base,
-                               aio_buf[data->buf_index].iov_len, data->offset, data->buf_index);
+  if (data->is_read && aio_buf_mode == URING_BUFFERS_RING)
+  {
+      // let the kernel pick a buffer from the provided buffer ring
+      io_uring_prep_read(sqe, data->src_fd, NULL, data->len, data->offset);
+      io_uring_sqe_set_flags(sqe, IOSQE_BUFFER_SELECT);
+      sqe->buf_group = AIO_BUF_GROUP;
+  }
+  else if (data->is_read)
+      aio_prep_buf_rw(sqe, true, data->src_fd, AIO_BUF_ADDR(data),
+                      data->len, data->offset, data->buf_index);
+  else if (data->falloc_mode >= 0)
+      io_uring_prep_fallocate(sqe, data->dst_fd, data->falloc_mode,
+                              data->offset, data->len);
   else
-      io_uring_prep_write_fixed(sqe, data->dst_fd, aio_buf[data->buf_index].iov_base,
-                                aio_buf[data->buf_index].iov_len, data->offset, data->buf_index);
+      aio_prep_buf_rw(sqe, false, data->dst_fd, AIO_BUF_ADDR(data),
+                      data->len, data->offset, data->buf_index);
+  if (data->fixed_file)
+      sqe->flags |= IOSQE_FIXED_FILE;
   io_uring_sqe_set_data(sqe, data);
+  inflight++;
+  (*data->cnt)++;
 
   // if (data->is_read)
   //   fprintf(stderr, "reading %s at offset %ld with length %ld using buffer with index %d\n",
-  //           data->src_name, data->offset, aio_buf[data->buf_index].iov_len, data->buf_index);
+  //           data->src_name, data->offset, data->len, data->buf_index);
   // else
   //   fprintf(stderr, "writing %s at offset %ld with length %ld using buffer with index %d\n",
-  //           data->dst_name, data->offset, aio_buf[data->buf_index].iov_len, data->buf_index);
+  //           data->dst_name, data->offset, data->len, data->buf_index);
 }
 
-/* AIO utils: submit prepared I/O requests */
-void aio_submit(int ready, int *cnt, char const *file_name, bool is_read)
+/* AIO utils: prepare a chunk as a read->write chain
+   The write is prepared with the length the read asked for; if the read
+   comes up short or fails, the kernel cancels the write and the chunk
+   is recovered in aio_finish_link.  */
+void aio_prep_link(struct aio_data *data)
 {
-  int ret;
-  while (ready)
-  {
-    ret = io_uring_submit(&aio_ring);
-    // fprintf(stderr, "ready: %d; ret: %d\n", ready, ret);
+  struct io_uring_sqe *sqe = io_uring_get_sqe(&aio_ring);
+  aio_prep_buf_rw(sqe, true, data->src_fd, AIO_BUF_ADDR(data),
+                  data->len, data->offset, data->buf_index);
+  io_uring_sqe_set_flags(sqe, IOSQE_IO_LINK | (aio_skip_success ? IOSQE_CQE_SKIP_SUCCESS : 0)
+                              | (data->fixed_file ? IOSQE_FIXED_FILE : 0));
+  io_uring_sqe_set_data(sqe, (void *)((uintptr_t)data | AIO_LINK_READ_TAG));
+
+  sqe = io_uring_get_sqe(&aio_ring);
+  aio_prep_buf_rw(sqe, false, data->dst_fd, AIO_BUF_ADDR(data),
+                  data->len, data->offset, data->buf_index);
+  io_uring_sqe_set_flags(sqe, data->fixed_file ? IOSQE_FIXED_FILE : 0);
+  io_uring_sqe_set_data(sqe, data);
 
-    if (ret < 0)
-    {
-      if (is_read)
-        fprintf(stderr, "error submitting I/O requests when reading %s: %s\n", file_name, strerror(-ret));
-      else
-        fprintf(stderr, "error submitting I/O requests when writing %s: %s\n", file_name, strerror(-ret));
-      aio_exit(true);
-    }
-    else if (ret == 0)
-    {
-      if (is_read)
-        fprintf(stderr, "error submitting I/O requests when reading %s: no submission\n", file_name);
-      else
-        fprintf(stderr, "error submitting I/O requests when writing %s: no submission\n", file_name);
+  data->is_read = false;
+  data->linked = true;
+  data->read_done = false;
+  data->write_done = false;
+  inflight += 2;
+  (*data->cnt) += 2;
+}
+
+/* AIO utils: number of prepared I/O requests not yet handed to the kernel
+   With SQ polling, requests already published to the SQ ring but not yet
+   picked up by the SQ thread do not count.  */
+unsigned aio_sq_pending()
+{
+  if (pio_engine)
+    return 0;
+  if (aio_sqpoll)
+    return aio_ring.sq.sqe_tail - aio_ring.sq.sqe_head;
+  return io_uring_sq_ready(&aio_ring);
+}
+
+/* AIO utils: publish prepared I/O requests to the SQ polling thread
+   Return true if that took a syscall to wake the thread up.  */
+bool aio_sqpoll_submit()
+{
+  unsigned pending = aio_sq_pending();
+  if (pending == 0) return false;
+
+  // io_uring_submit only enters the kernel if the SQ thread sleeps
+  bool wakeup = IO_URING_READ_ONCE(*aio_ring.sq.kflags) & IORING_SQ_NEED_WAKEUP;
+  int ret = io_uring_submit(&aio_ring);
+  if (ret < 0)
+  {
+    fprintf(stderr, "error submitting I/O requests: %s\n", strerror(-ret));
+    aio_exit(true);
+  }
+  aio_stats.sqes += pending;
+  if (wakeup)
+  {
+    aio_stats.enters++;
+    aio_stats.wakeups++;
+  }
+  return wakeup;
+}
+
+/* AIO utils: submit all prepared I/O requests */
+void aio_submit()
+{
+  if (aio_sqpoll)
+  {
+    if (aio_sq_pending() && !aio_sqpoll_submit())
+      aio_stats.avoided++;
+    return;
+  }
+
+  while (io_uring_sq_ready(&aio_ring))
+  {
+    int ret = io_uring_submit(&aio_ring);
+    aio_stats.enters++;
+
+    if (ret < 0)
+    {
+      fprintf(stderr, "error submitting I/O requests: %s\n", strerror(-ret));
+      aio_exit(true);
+    }
+    else if (ret == 0)
+    {
+      fprintf(stderr, "error submitting I/O requests: no submission\n");
+      aio_exit(true);
+    }
+    aio_stats.sqes += ret;
+  }
+}
+
+/* AIO utils: submit all prepared I/O requests and reap completions
+   A single io_uring_enter hands over the prepared SQEs and waits for
+   WAIT_NR completions.  Completions are then reaped in batches of up to
+   AIO_REAP_BATCH; follow-up requests they trigger are only prepared,
+   and go out with the next call.  */
+void aio_reap(unsigned wait_nr)
+{
+  struct io_uring_cqe *cqes[AIO_REAP_BATCH];
+  unsigned n;
+
+  // the SQ thread submits on its own: only wait if completions are missing
+  if (aio_sqpoll && io_uring_cq_ready(&aio_ring) >= wait_nr)
+  {
+    if (!aio_sqpoll_submit())
+      aio_stats.avoided++;
+  }
+  else
+  {
+    unsigned submitted = aio_sq_pending();
+    int ret = io_uring_submit_and_wait(&aio_ring, wait_nr);
+    aio_stats.enters++;
+    if (ret < 0 && ret != -EINTR)
+    {
+      fprintf(stderr, "error getting completed I/O requests: %s\n", strerror(-ret));
       aio_exit(true);
     }
+    aio_stats.sqes += submitted;
+  }
 
-    ready -= ret;
-    inflight += ret;
-    *cnt += ret;
+  while ((n = io_uring_peek_batch_cqe(&aio_ring, cqes, AIO_REAP_BATCH)) > 0)
+  {
+    for (unsigned i = 0; i < n; i++)
+      aio_proc_cqe(cqes[i]);
+    io_uring_cq_advance(&aio_ring, n);
+    aio_stats.cqes += n;
+    aio_stats.batches++;
   }
+
+  // completions returned ring space and buffers: resume parked files
+  aio_file_pump();
 }
 
-/* AIO utils: process the completed I/O requests */
-void aio_proc_cqe(struct io_uring_cqe *cqe, bool *write_comp)
+/* AIO utils: number of completions worth waiting for in aio_reap
+   Wait for a batch, but never for more CQEs than the inflight requests
+   are guaranteed to post: a linked chain may post a single CQE.  */
+unsigned aio_reap_nr()
 {
-  int ret;
-  struct aio_data *data = io_uring_cqe_get_data(cqe);
+  int nr = aio_link ? inflight / 2 : inflight;
+  if (nr > AIO_REAP_BATCH) nr = AIO_REAP_BATCH;
+  return nr > 0 ? nr : 1;
+}
+
+/* AIO utils: process the completed I/O requests
+   The caller marks CQE as seen.  */
+void aio_proc_cqe(struct io_uring_cqe *cqe)
+{
+  uintptr_t user_data = (uintptr_t)io_uring_cqe_get_data(cqe);
+  if (user_data & AIO_FILE_TAG)
+  {
+    inflight--;
+    aio_file_proc_cqe(cqe, (struct aio_file_op *)(user_data & ~AIO_FILE_TAG));
+    return;
+  }
+
+  struct aio_data *data = (struct aio_data *)(user_data & ~AIO_LINK_READ_TAG);
   inflight--;
   (*data->cnt)--;
 
+  if (data->linked)
+  {
+    aio_proc_link_cqe(cqe, data, user_data & AIO_LINK_READ_TAG);
+    return;
+  }
+
+  // pick up the buffer the kernel selected for a read
+  if (cqe->flags & IORING_CQE_F_BUFFER)
+    data->buf_index = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
   // do not process the completed request if an I/O error has occured
   if (*data->io_error)
-  {
-    io_uring_cqe_seen(&aio_ring, cqe);
     aio_free_data(data);
-    if (write_comp) *write_comp = true;
+  // a fallocate completes with 0; without hole punching the range
+  // is left alone, and reads back as zeros all the same
+  else if (data->falloc_mode >= 0
+           && (cqe->res == 0
+               || (data->falloc_mode == AIO_FALLOC_PUNCH
+                   && (cqe->res == -EOPNOTSUPP || cqe->res == -ENOSYS))))
+    aio_write_done(data);
+  // out of provided buffers: grow the pool, or wait for a write to return one
+  else if (cqe->res == -ENOBUFS && data->is_read && aio_buf_mode == URING_BUFFERS_RING)
+  {
+    if (aio_buf_grow() == 0)
+    {
+      aio_prep_rw(data);
+      return;
+    }
+    (*data->cnt)++;
+    data->next = NULL;
+    if (aio_nobuf_tail) aio_nobuf_tail->next = data;
+    else aio_nobuf_head = data;
+    aio_nobuf_tail = data;
+  }
+  // a read that hit the end of a file that shrank ends its chunk there
+  else if (cqe->res == 0 && data->is_read && aio_buf_mode != URING_BUFFERS_RING)
+  {
+    data->len = 0;
+    aio_read_done(data);
+  }
+  // an incomplete read or write goes on with the rest of its range; a
+  // provided buffer is only kept once the read is complete, so such a
+  // read is redone below
+  else if (cqe->res > 0 && (size_t)cqe->res < data->len && data->falloc_mode < 0
+           && !(data->is_read && aio_buf_mode == URING_BUFFERS_RING))
+  {
+    data->offset += cqe->res;
+    data->seg_off += cqe->res;
+    data->len -= cqe->res;
+    aio_prep_rw(data);
   }
   // resubmit the request if I/O request is canceled or incomplete
-  else if (cqe->res == -EAGAIN || cqe->res == -ECANCELED || (cqe->res >= 0 && cqe->res != aio_buf[data->buf_index].iov_len))
+  else if (cqe->res == -EAGAIN || cqe->res == -ECANCELED || (cqe->res >= 0 && cqe->res != data->len))
   {
+    // a provided buffer is only kept once the read is complete
+    if (data->is_read && aio_buf_mode == URING_BUFFERS_RING)
+      aio_release_buf(data);
     aio_prep_rw(data);
-    io_uring_cqe_seen(&aio_ring, cqe);
-    aio_submit(1, data->cnt, data->is_read ? data->src_name : data->dst_name, data->is_read);
   }
   // I/O error
   else if (cqe->res < 0)
   {
-    ret = cqe->res;
-    io_uring_cqe_seen(&aio_ring, cqe);
     *data->io_error = true;
+    aio_fail();
 
     if (data->is_read)
-      fprintf(stderr, "error reading %s: %s\n", data->src_name, strerror(-ret));
+      fprintf(stderr, "error reading %s: %s\n", data->src_name, strerror(-cqe->res));
+    else if (data->falloc_mode == AIO_FALLOC_PUNCH)
+      fprintf(stderr, "error deallocating %s: %s\n", data->dst_name, strerror(-cqe->res));
+    else if (data->falloc_mode >= 0)
+      fprintf(stderr, "error allocating %s: %s\n", data->dst_name, strerror(-cqe->res));
     else
-      fprintf(stderr, "error writing %s: %s\n", data->dst_name, strerror(-ret));
+      fprintf(stderr, "error writing %s: %s\n", data->dst_name, strerror(-cqe->res));
     aio_free_data(data);
-    if (write_comp) *write_comp = true;
   }
-  // a successful read launches the corresponding write
   else if (data->is_read)
+    aio_read_done(data);
+  // a successful write results in an available entry in AIO queue and an availble AIO buffer
+  else
+    aio_write_done(data);
+}
+
+/* AIO utils: the read of DATA completed, or hit the end of the file
+   A successful read launches the corresponding write, or the first
+   write of its non-zero data.  A read done in several requests has
+   DATA's offset and len on the last one, and seg_off past the others.  */
+void aio_read_done(struct aio_data *data)
+{
+  data->offset -= data->seg_off;
+  data->len += data->seg_off;
+  data->seg_off = 0;
+  data->is_read = false;
+  if (data->len == 0)
+    aio_free_data(data);
+  else if (data->hole_size == 0)
+    aio_prep_rw(data);
+  else
+  {
+    data->data_end = data->offset + data->len;
+    data->len = 0;
+    if (aio_next_seg(data))
+      aio_prep_rw(data);
+    else
+    {
+      aio_tune(data);
+      aio_free_data(data);
+    }
+  }
+}
+
+/* AIO utils: a write (or hole punch) of DATA completed
+   Move on to the next segment of a chunk read with zero detection.  */
+void aio_write_done(struct aio_data *data)
+{
+  if (data->hole_size && aio_next_seg(data))
+  {
+    aio_prep_rw(data);
+    return;
+  }
+  // a range allocated on its own says nothing about transfer speed
+  if (data->falloc_mode < 0 || data->hole_size)
+    aio_tune(data);
+  aio_free_data(data);
+}
+
+/* AIO utils: pick the next request of a chunk read with zero detection
+   The chunk is cut into blocks of hole_size bytes, counted from the
+   start of the read, and into runs of blocks that are all zeros or all
+   not.  Runs of data are written; zero runs are punched out if
+   punch_holes, or else skipped, leaving a hole in a new destination.
+   DATA's offset, seg_off and len describe the request just done.
+   Return false if none is left.  */
+bool aio_next_seg(struct aio_data *data)
+{
+  off_t start = data->offset - data->seg_off;     // offset of the read
+  size_t end = data->data_end - start;
+  size_t pos = data->seg_off + data->len;
+  char *base = AIO_BUF_ADDR(data) - data->seg_off;
+
+  while (pos < end)
+  {
+    bool zero = zero_scan(base + pos, MIN(data->hole_size, end - pos));
+    size_t run_end = pos;
+    do
+      run_end += MIN(data->hole_size, end - run_end);
+    while (run_end < end
+           && zero_scan(base + run_end, MIN(data->hole_size, end - run_end)) == zero);
+
+    if (!zero || data->punch_holes)
+    {
+      data->seg_off = pos;
+      data->offset = start + pos;
+      data->len = run_end - pos;
+      data->falloc_mode = zero ? AIO_FALLOC_PUNCH : -1;
+      return true;
+    }
+    pos = run_end;
+  }
+  return false;
+}
+
+/* AIO utils: process a completed half of a read->write chain */
+void aio_proc_link_cqe(struct io_uring_cqe *cqe, struct aio_data *data, bool is_read)
+{
+  if (is_read)
+  {
+    data->read_done = true;
+    data->read_res = cqe->res;
+    // a read whose CQE is skipped on success only posts one when it
+    // fails or comes up short, and then the kernel skips the CQE of the
+    // write it cancels too: account for the write's SQE here
+    if (aio_skip_success && cqe->res != (int)data->len)
+    {
+      inflight--;
+      (*data->cnt)--;
+      data->write_done = true;
+      data->write_res = -ECANCELED;
+    }
+  }
+  else
+  {
+    // the CQE of a successful read was skipped, account for its SQE here
+    if (!data->read_done && cqe->res != -ECANCELED)
+    {
+      inflight--;
+      (*data->cnt)--;
+      data->read_done = true;
+      data->read_res = data->len;
+    }
+    data->write_done = true;
+    data->write_res = cqe->res;
+  }
+
+  if (data->read_done && data->write_done)
+    aio_finish_link(data);
+}
+
+/* AIO utils: finish a read->write chain once both halves are reaped
+   A broken chain falls back to the unlinked path: the rest of the chunk
+   is read on its own, and aio_proc_cqe takes care of short reads and of
+   launching the write.  */
+void aio_finish_link(struct aio_data *data)
+{
+  size_t len = data->len;
+  data->linked = false;
+
+  if (*data->io_error)
+    aio_free_data(data);
+  // read failed for good
+  else if (data->read_res < 0 && data->read_res != -EAGAIN && data->read_res != -ECANCELED)
+  {
+    *data->io_error = true;
+    aio_fail();
+    fprintf(stderr, "error reading %s: %s\n", data->src_name, strerror(-data->read_res));
+    aio_free_data(data);
+  }
+  // short or canceled read broke the chain: read the rest of the
+  // chunk unlinked, unless the file ended
+  else if (data->read_res != len)
+  {
+    data->is_read = true;
+    if (data->read_res == 0)
+    {
+      data->len = 0;
+      aio_read_done(data);
+      return;
+    }
+    if (data->read_res > 0)
+    {
+      data->offset += data->read_res;
+      data->seg_off += data->read_res;
+      data->len -= data->read_res;
+    }
+    aio_prep_rw(data);
+  }
+  // write failed for good
+  else if (data->write_res < 0 && data->write_res != -EAGAIN && data->write_res != -ECANCELED)
+  {
+    *data->io_error = true;
+    aio_fail();
+    fprintf(stderr, "error writing %s: %s\n", data->dst_name, strerror(-data->write_res));
+    aio_free_data(data);
+  }
+  // short or canceled write: the buffer holds the data, redo the write
+  else if (data->write_res != len)
   {
     data->is_read = false;
     aio_prep_rw(data);
-    io_uring_cqe_seen(&aio_ring, cqe);
-    aio_submit(1, data->cnt, data->dst_name, false);
   }
-  // a successful write results in an available entry in AIO queue and an availble AIO buffer
   else
   {
-    io_uring_cqe_seen(&aio_ring, cqe);
+    aio_tune(data);
     aio_free_data(data);
-    if (write_comp) *write_comp = true;
   }
 }
 
 /* AIO utils: wait for all inflight requests to complete */
 void aio_wait_all_comp()
 {
-  struct io_uring_cqe *cqe;
-  while (inflight > 0)
+  while (inflight > 0 || aio_file_parked_head)
   {
-      int ret = io_uring_wait_cqe(&aio_ring, &cqe);
-      if (ret < 0)
-      {
-          fprintf(stderr, "error getting completed I/O requests: %s\n", strerror(-ret));
-          aio_exit(true);
-      }
-      aio_proc_cqe(cqe, NULL);
+    if (inflight == 0)
+    {
+      fprintf(stderr, "error getting buffer from aio_buf_queue when reading %s\n",
+              aio_file_parked_head->src_name);
+      aio_exit(true);
+    }
+    aio_reap(aio_reap_nr());
+  }
+}
+
+/* AIO utils: get an SQE, flushing the SQ ring if it is full
+   Requests prepared while handling CQEs may briefly outnumber the
+   slots inflight accounts for.  */
+struct io_uring_sqe *aio_get_sqe()
+{
+  struct io_uring_sqe *sqe;
+  while ((sqe = io_uring_get_sqe(&aio_ring)) == NULL)
+    aio_submit();
+  return sqe;
+}
+
+/* AIO utils: describe in OUT how many engines had each of the N kinds
+   of COUNT, or just the kind if they all had the same */
+static void aio_stats_mix(char *out, size_t size, char const *const *name,
+                          unsigned long long const *count, int n)
+{
+  int kinds = 0;
+  for (int i = 0; i < n; i++)
+    kinds += count[i] != 0;
+
+  size_t len = 0;
+  *out = '\0';
+  for (int i = 0; i < n && len < size; i++)
+  {
+    if (count[i] == 0)
+      continue;
+    if (kinds == 1)
+      len += snprintf(out + len, size - len, "%s", name[i]);
+    else
+      len += snprintf(out + len, size - len, "%s%llu %s", len ? ", " : "",
+                      count[i], name[i]);
+  }
+}
+
+/* AIO utils: print statistics */
+void aio_stats_print()
+{
+  if (pio_engine)
+    fprintf(stderr, "io_uring: unavailable (%s), %llu chunks read and %llu "
+            "written with pread/pwrite by %zu threads\n", strerror(pio_errno),
+            pio_reads, pio_writes, pio_threads + 1);
+  else
+  {
+    fprintf(stderr, "io_uring: %llu SQEs submitted, %llu CQEs reaped in %llu batches, "
+            "%llu submit/wait calls\n", aio_stats.sqes, aio_stats.cqes,
+            aio_stats.batches, aio_stats.enters);
+    if (aio_sqpoll)
+      fprintf(stderr, "io_uring: SQ polling saved %llu syscalls, woke the SQ thread "
+              "%llu times\n", aio_stats.avoided, aio_stats.wakeups);
+    fprintf(stderr, "io_uring: %llu files opened and closed through the ring, "
+            "%llu by one linked chain\n", aio_stats.files, aio_stats.small_files);
   }
+  char reg[64], backing[96];
+  aio_stats_mix(reg, sizeof reg, aio_buf_reg_name, aio_stats.registration, 3);
+  aio_stats_mix(backing, sizeof backing, aio_arena_name, aio_stats.backing, 4);
+  fprintf(stderr, "io_uring: %llu of %llu AIO buffers allocated by %llu "
+          "engine%s (%s registration), backed by %s\n", aio_stats.buffers,
+          aio_stats.buffer_max, aio_stats.engines,
+          aio_stats.engines == 1 ? "" : "s", reg, backing);
+  if (aio_stats.fd_waits)
+    fprintf(stderr, "io_uring: waited %llu times for one of %d file descriptors "
+            "to close\n", aio_stats.fd_waits, aio_fd_budget);
+  if (aio_stats.sched_small + aio_stats.sched_large)
+    fprintf(stderr, "io_uring: %s scheduling: %llu small files in %.1f ms "
+            "(max %.1f), %llu large files in %.1f ms (max %.1f)\n",
+            aio_sched_name[aio_sched], aio_stats.sched_small,
+            aio_stats.sched_small ? 1e3 * aio_stats.sched_small_time
+                                    / aio_stats.sched_small : 0.0,
+            1e3 * aio_stats.sched_small_max, aio_stats.sched_large,
+            aio_stats.sched_large ? 1e3 * aio_stats.sched_large_time
+                                    / aio_stats.sched_large : 0.0,
+            1e3 * aio_stats.sched_large_max);
+  if (aio_stats.engines > 1)
+    fprintf(stderr, "io_uring: %llu worker engines, %llu files and ranges stolen\n",
+            aio_stats.engines - 1, aio_stats.steals);
+  if (aio_stats.clones + aio_stats.clone_copies)
+    fprintf(stderr, "io_uring: %llu extents cloned, %llu copied through the ring\n",
+            aio_stats.clones, aio_stats.clone_copies);
+  if (aio_stats.range_files)
+    fprintf(stderr, "io_uring: %llu files copied by copy_file_range instead\n",
+            aio_stats.range_files);
+}
+
+/* AIO utils: record this engine's buffers in its statistics, once, as
+   it is torn down */
+void aio_stats_engine()
+{
+  aio_stats.engines = 1;
+  aio_stats.buffers = aio_buf_count;
+  aio_stats.buffer_max = aio_buf_max;
+  aio_stats.registration[!aio_buf_fixed ? 0 : aio_buf_sparse ? 1 : 2] = 1;
+  aio_stats.backing[aio_arena_backing] = 1;
+}
+
+/* AIO utils: add this engine's statistics to the totals */
+void aio_stats_merge()
+{
+  pthread_mutex_lock(&aio_pool_lock);
+  aio_stats_total.engines += aio_stats.engines;
+  aio_stats_total.buffers += aio_stats.buffers;
+  aio_stats_total.buffer_max += aio_stats.buffer_max;
+  for (int i = 0; i < 3; i++)
+    aio_stats_total.registration[i] += aio_stats.registration[i];
+  for (int i = 0; i < 4; i++)
+    aio_stats_total.backing[i] += aio_stats.backing[i];
+  aio_stats_total.enters += aio_stats.enters;
+  aio_stats_total.avoided += aio_stats.avoided;
+  aio_stats_total.wakeups += aio_stats.wakeups;
+  aio_stats_total.sqes += aio_stats.sqes;
+  aio_stats_total.cqes += aio_stats.cqes;
+  aio_stats_total.batches += aio_stats.batches;
+  aio_stats_total.files += aio_stats.files;
+  aio_stats_total.small_files += aio_stats.small_files;
+  aio_stats_total.fd_waits += aio_stats.fd_waits;
+  aio_stats_total.steals += aio_stats.steals;
+  aio_stats_total.clones += aio_stats.clones;
+  aio_stats_total.clone_copies += aio_stats.clone_copies;
+  aio_stats_total.range_files += aio_stats.range_files;
+  aio_stats_total.sched_small += aio_stats.sched_small;
+  aio_stats_total.sched_large += aio_stats.sched_large;
+  aio_stats_total.sched_small_time += aio_stats.sched_small_time;
+  aio_stats_total.sched_large_time += aio_stats.sched_large_time;
+  aio_stats_total.sched_small_max = MAX(aio_stats_total.sched_small_max,
+                                        aio_stats.sched_small_max);
+  aio_stats_total.sched_large_max = MAX(aio_stats_total.sched_large_max,
+                                        aio_stats.sched_large_max);
+  pthread_mutex_unlock(&aio_pool_lock);
+  memset(&aio_stats, 0, sizeof aio_stats);
+}
+
+/* AIO utils: current monotonic time in seconds */
+double aio_now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* AIO utils: choose the size of the next request of a transfer
+   BUF_SIZE is the I/O unit of the (src, dst) pair, i.e. the least common
+   multiple of their preferred block sizes, and MAX_N_READ the number of
+   bytes left to read.  Files that fit in one block are read in a single
+   request of exactly their size; larger transfers use the block size of
+   TUNER, rounded to a multiple of BUF_SIZE and capped by AIO_BLKSIZE.  */
+size_t aio_chunk_size(struct aio_tuner const *tuner, size_t buf_size,
+                      uintmax_t max_n_read)
+{
+  size_t io_size = tuner->blksize;
+
+  if (buf_size == 0 || AIO_BLKSIZE < buf_size)
+    buf_size = AIO_MIN_BLKSIZE;
+  io_size += buf_size - 1;
+  io_size -= io_size % buf_size;
+  if (AIO_BLKSIZE < io_size)
+    io_size = AIO_BLKSIZE - AIO_BLKSIZE % buf_size;
+
+  // do not leave a tail smaller than half a block behind
+  if (max_n_read <= io_size + io_size / 2)
+    return max_n_read <= AIO_BLKSIZE ? max_n_read : io_size;
+  return io_size;
+}
+
+/* AIO utils: feed a chunk of LEN bytes, started at SUBMIT_TIME and
+   completed now, to TUNER */
+void aio_tuner_update(struct aio_tuner *tuner, size_t len, double submit_time)
+{
+  double now = aio_now();
+
+  if (tuner->cnt == 0)
+    tuner->start = submit_time;
+  tuner->cnt++;
+  tuner->bytes += len;
+  tuner->latency += now - submit_time;
+  if (tuner->cnt < AIO_TUNE_WINDOW || now <= tuner->start)
+    return;
+
+  double bw = tuner->bytes / (now - tuner->start);
+  if (tuner->latency / tuner->cnt > AIO_TUNE_MAX_LATENCY)
+    tuner->dir = -1;
+  else if (bw < tuner->bw)
+    tuner->dir = -tuner->dir;
+
+  if (tuner->dir > 0 && tuner->blksize * 2 <= AIO_BLKSIZE)
+    tuner->blksize *= 2;
+  else if (tuner->dir < 0 && tuner->blksize / 2 >= AIO_MIN_BLKSIZE)
+    tuner->blksize /= 2;
+
+  tuner->bw = bw;
+  tuner->cnt = 0;
+  tuner->bytes = 0;
+  tuner->latency = 0;
+}
+
+/* AIO utils: feed a completed chunk to this engine's block size tuner
+   With zero detection, DATA describes the last segment written: count
+   the whole chunk read, from the start of the read to data_end.  */
+void aio_tune(struct aio_data *data)
+{
+  size_t len = data->len;
+  if (data->hole_size)
+    len = data->data_end - (data->offset - data->seg_off);
+  aio_tuner_update(&aio_tuner, len, data->submit_time);
+}
+
+/* Thread-pool engine
+   Where no ring can be set up, for instance when a seccomp profile
+   blocks io_uring_setup, aio_engine_init sets pio_engine and
+   sparse_copy hands each copy to pio_copy.  The copy is cut into the
+   chunks aio_chunk_size picks, read with pread and written with pwrite
+   by PIO_THREADS threads (or one per --threads, if more) and the
+   calling thread, in buffers carved out of the engine's arena.  There
+   are PIO_BUFS_PER_THREAD buffers per thread, so that chunks are read
+   while others are written: a thread writes a chunk already read if
+   there is one, and otherwise reads the next chunk into a free buffer.
+   Files are copied one at a time, and ring-only paths (aio_file_start
+   and the worker engines) are not used.  The threads live from pio_init
+   to pio_exit, which aio_exit calls at the end of each copy.  They
+   share pio_tuner, which every chunk written feeds, as the ring's
+   completions feed the engine's tuner.  */
+#define PIO_THREADS 4
+#define PIO_BUFS_PER_THREAD 2
+
+struct pio_chunk
+{
+  char *buf;
+  off_t offset;
+  size_t len;
+  double submit_time;           /* when its read started */
+};
+
+/* A copy in progress.  */
+struct pio_copy
+{
+  int src_fd;
+  int dest_fd;
+  size_t buf_size;
+  size_t hole_size;
+  bool punch_holes;
+  off_t next;                   /* offset of the next chunk to read */
+  off_t end;                    /* end of the range, or of the file */
+  off_t n_read;                 /* bytes read so far */
+  size_t busy;                  /* chunks being read or written */
+  int read_err;                 /* first errno of a read */
+  int write_err;                /* first errno of a write or punch */
+  bool punch_failed;            /* write_err is that of a punch */
+};
+
+static pthread_mutex_t pio_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pio_cond = PTHREAD_COND_INITIALIZER;
+
+static struct pio_copy *pio_job;
+static char *pio_free[QD];              /* buffers not in use */
+static size_t pio_nfree;
+static struct pio_chunk pio_ready[QD];  /* chunks read, not yet written */
+static size_t pio_nready;
+static struct aio_tuner pio_tuner = AIO_TUNER_INIT;
+static pthread_t *pio_tids;             /* the pool threads */
+static bool pio_stopping;               /* tells them to exit */
+
+/* Read (or write, unless IS_READ) LEN bytes at OFFSET of FD, going on
+   after short transfers.  Return the number of bytes transferred,
+   fewer than LEN only at the end of the file, or -1 with errno set.  */
+static ssize_t
+pio_transfer (bool is_read, int fd, char *buf, size_t len, off_t offset)
+{
+  size_t done = 0;
+  while (done < len)
+    {
+      ssize_t n = (is_read
+                   ? pread (fd, buf + done, len - done, offset + done)
+                   : pwrite (fd, buf + done, len - done, offset + done));
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n < 0)
+        return -1;
+      if (n == 0)
+        {
+          if (is_read)
+            break;
+          errno = ENOSPC;
+          return -1;
+        }
+      done += n;
+    }
+  return done;
+}
+
+/* Write CHUNK of JOB, leaving out its zero blocks, or punching them out
+   if JOB->punch_holes, as aio_next_seg does.  Return 0, or an errno and
+   set JOB->punch_failed if a punch failed.  */
+static int
+pio_write (struct pio_copy *job, struct pio_chunk const *chunk)
+{
+  size_t pos = 0;
+  while (pos < chunk->len)
+    {
+      bool zero = false;
+      size_t run_end = chunk->len;
+      if (job->hole_size)
+        {
+          zero = zero_scan (chunk->buf + pos,
+                            MIN (job->hole_size, chunk->len - pos));
+          run_end = pos;
+          do
+            run_end += MIN (job->hole_size, chunk->len - run_end);
+          while (run_end < chunk->len
+                 && zero_scan (chunk->buf + run_end,
+                               MIN (job->hole_size, chunk->len - run_end))
+                    == zero);
+        }
+
+      off_t offset = chunk->offset + pos;
+      size_t len = run_end - pos;
+      if (zero && job->punch_holes && punch_hole (job->dest_fd, offset, len) < 0)
+        {
+          job->punch_failed = true;
+          return errno;
+        }
+      if (! zero
+          && pio_transfer (false, job->dest_fd, chunk->buf + pos, len, offset) < 0)
+        return errno;
+      pos = run_end;
+    }
+  return 0;
+}
+
+/* Do one step of the current copy: write a chunk that was read, or read
+   the next one.  The caller holds pio_lock, which is released during
+   the I/O.  Return false if there was nothing to do.  */
+static bool
+pio_step (void)
+{
+  struct pio_copy *job = pio_job;
+  if (job == NULL)
+    return false;
+
+  if (pio_nready)
+    {
+      struct pio_chunk chunk = pio_ready[--pio_nready];
+      job->busy++;
+      pthread_mutex_unlock (&pio_lock);
+      int err = job->write_err ? 0 : pio_write (job, &chunk);
+      pthread_mutex_lock (&pio_lock);
+      if (err && ! job->write_err)
+        job->write_err = err;
+      else if (! job->write_err)
+        aio_tuner_update (&pio_tuner, chunk.len, chunk.submit_time);
+      pio_writes++;
+      pio_free[pio_nfree++] = chunk.buf;
+    }
+  else if (pio_nfree && job->next < job->end
+           && ! job->read_err && ! job->write_err)
+    {
+      struct pio_chunk chunk;
+      chunk.buf = pio_free[--pio_nfree];
+      chunk.offset = job->next;
+      chunk.len = aio_chunk_size (&pio_tuner, job->buf_size,
+                                  job->end - job->next);
+      chunk.submit_time = aio_now ();
+      job->next += chunk.len;
+      job->busy++;
+      pthread_mutex_unlock (&pio_lock);
+      ssize_t n = pio_transfer (true, job->src_fd, chunk.buf, chunk.len,
+                                chunk.offset);
+      pthread_mutex_lock (&pio_lock);
+      if (n < 0)
+        {
+          if (! job->read_err)
+            job->read_err = errno;
+          n = 0;
+        }
+      else if ((size_t) n < chunk.len)
+        {
+          /* The file ended early: do not read past its end.  */
+          job->end = MIN (job->end, chunk.offset + n);
+        }
+      job->n_read += n;
+      pio_reads++;
+      chunk.len = n;
+      if (n)
+        pio_ready[pio_nready++] = chunk;
+      else
+        pio_free[pio_nfree++] = chunk.buf;
+    }
+  else
+    return false;
+
+  job->busy--;
+  pthread_cond_broadcast (&pio_cond);
+  return true;
+}
+
+static void *
+pio_thread (void *arg _GL_UNUSED)
+{
+  pthread_mutex_lock (&pio_lock);
+  while (! pio_stopping)
+    if (! pio_step ())
+      pthread_cond_wait (&pio_cond, &pio_lock);
+  pthread_mutex_unlock (&pio_lock);
+  return NULL;
+}
+
+/* Set up the thread-pool engine in place of a ring that could not be
+   set up for the reason ERR, or for the same one as before if ERR is 0:
+   start the threads, unless they are already running, and give them
+   their buffers.  Return false on failure.  */
+static bool
+pio_init (struct cp_options const *options, int err)
+{
+  pio_engine = true;
+  if (err)
+    pio_errno = err;
+  aio_print_stats = options->uring_stats;
+
+  /* The copying thread is the only engine.  */
+  if (aio_buf_queue_init (options->buffer_memory, 1) < 0)
+    return false;
+  aio_slab_init ();
+
+  if (! pio_tids)
+    {
+      size_t n = MAX (PIO_THREADS, options->threads);
+      pio_tids = xnmalloc (n, sizeof *pio_tids);
+      while (pio_threads < n
+             && pthread_create (&pio_tids[pio_threads], NULL,
+                                pio_thread, NULL) == 0)
+        pio_threads++;
+    }
+
+  int n_bufs = MIN (aio_buf_max, PIO_BUFS_PER_THREAD * ((int) pio_threads + 1));
+  pthread_mutex_lock (&pio_lock);
+  pio_nfree = pio_nready = 0;
+  for (; aio_buf_count < n_bufs; aio_buf_count++)
+    {
+      if (aio_buf_alloc (aio_buf_count) < 0)
+        {
+          pthread_mutex_unlock (&pio_lock);
+          aio_exit (false);
+          return false;
+        }
+      pio_free[pio_nfree++] = aio_buf[aio_buf_count].iov_base;
+    }
+  pthread_mutex_unlock (&pio_lock);
+  return true;
+}
+
+/* Stop the threads pio_init started and wait for them to exit.  They
+   are idle: a copy is over once pio_copy returns.  */
+static void
+pio_exit (void)
+{
+  pthread_mutex_lock (&pio_lock);
+  pio_stopping = true;
+  pthread_cond_broadcast (&pio_cond);
+  pthread_mutex_unlock (&pio_lock);
+  for (size_t i = 0; i < pio_threads; i++)
+    pthread_join (pio_tids[i], NULL);
+  free (pio_tids);
+  pio_tids = NULL;
+  pio_threads = 0;
+  pio_stopping = false;
+}
+
+/* Whether JOB is over.  Threads record their errors in JOB before they
+   drop JOB->busy, under pio_lock, so once this is true every error of
+   every chunk is in JOB->read_err or JOB->write_err.  */
+static bool
+pio_done (struct pio_copy const *job)
+{
+  return (job->busy == 0 && pio_nready == 0
+          && (job->end <= job->next || job->read_err || job->write_err));
+}
+
+/* Copy like sparse_copy, on the thread pool, and return once the data
+   is written.  Set *IO_ERROR on an I/O error.  */
+static bool
+pio_copy (int src_fd, int dest_fd, size_t buf_size,
+          size_t hole_size, bool punch_holes,
+          char *src_name, char *dst_name,
+          uintmax_t max_n_read, off_t *total_n_read,
+          off_t start_offset, bool *io_error)
+{
+  struct pio_copy job;
+  memset (&job, 0, sizeof job);
+  job.src_fd = src_fd;
+  job.dest_fd = dest_fd;
+  job.buf_size = buf_size;
+  job.hole_size = hole_size;
+  job.punch_holes = punch_holes;
+  job.next = start_offset;
+  job.end = start_offset + max_n_read;
+
+  pthread_mutex_lock (&pio_lock);
+  pio_job = &job;
+  pthread_cond_broadcast (&pio_cond);
+  while (! pio_done (&job))
+    if (! pio_step ())
+      pthread_cond_wait (&pio_cond, &pio_lock);
+  pio_job = NULL;
+  pthread_mutex_unlock (&pio_lock);
+
+  *total_n_read = job.n_read;
+  if (! job.read_err && ! job.write_err)
+    return true;
+
+  *io_error = true;
+  aio_fail ();
+  if (job.read_err)
+    fprintf (stderr, "error reading %s: %s\n", src_name,
+             strerror (job.read_err));
+  if (job.write_err)
+    fprintf (stderr, "error %s %s: %s\n",
+             job.punch_failed ? "deallocating" : "writing", dst_name,
+             strerror (job.write_err));
+  return false;
 }
 
 /* Copy the regular file open on SRC_FD/SRC_NAME to DST_FD/DST_NAME,
-   honoring the MAKE_HOLES setting and using the BUF_SIZE-byte buffer
-   BUF for temporary storage.  Copy no more than MAX_N_READ bytes.
+   using requests whose size is chosen at runtime by aio_chunk_size
+   from the BUF_SIZE-byte I/O unit.  Unless HOLE_SIZE is 0, blocks of
+   HOLE_SIZE bytes that read as zeros are not written but skipped, or
+   punched out if PUNCH_HOLES.
+   Copy no more than MAX_N_READ bytes, from START_OFFSET in both files.
    Return true upon successful completion;
    print a diagnostic and return false upon error.
-   Note that for best results, BUF should be "well"-aligned.
-   BUF must have sizeof(uintptr_t)-1 bytes of additional space
-   beyond BUF[BUF_SIZE-1].
    Set *LAST_WRITE_MADE_HOLE to true if the final operation on
-   DEST_FD introduced a hole.  Set *TOTAL_N_READ to the number of
+   DEST_FD may introduce a hole.  Set *TOTAL_N_READ to the number of
    bytes read.  */
 static bool
-sparse_copy (int src_fd, int dest_fd,
+sparse_copy (int src_fd, int dest_fd, size_t buf_size,
              size_t hole_size, bool punch_holes,
              char *src_name, char *dst_name,
              uintmax_t max_n_read, off_t *total_n_read,
-             int start_offset, int *cnt, bool *all_read_submit,
+             off_t start_offset, int *cnt, bool *all_read_submit,
              bool *io_error, bool *last_write_made_hole)
 {
-  *last_write_made_hole = false;
+  /* Zero blocks are found when each read completes (see aio_next_seg),
+     long after we return, so a trailing one may become a hole: let the
+     caller set the size.  */
+  *last_write_made_hole = hole_size != 0;
   *total_n_read = 0;
-  bool make_hole = false;
+  if (pio_engine)
+    return pio_copy(src_fd, dest_fd, buf_size, hole_size, punch_holes,
+                    src_name, dst_name, max_n_read, total_n_read,
+                    start_offset, io_error);
+
   off_t offset = start_offset;
-  int ret;
+  int need = aio_link ? 2 : 1;      // SQEs taken by one chunk
 
   while (max_n_read)
   {
-    int ready = 0;
-
     // prepare as many reads as possible
-    while (max_n_read && inflight + ready < QD)
+    while (max_n_read && inflight + need <= aio_depth)
     {
-      off_t io_size = (max_n_read < AIO_BLKSIZE) ? max_n_read : AIO_BLKSIZE;
+      off_t io_size = aio_chunk_size(&aio_tuner, buf_size, max_n_read);
 
       struct aio_data *data = NULL;
       data = (struct aio_data *)malloc(sizeof(struct aio_data));
       if (data == NULL)
       {
         fprintf(stderr, "error allocating aio_data when reading %s\n", src_name);
-        if (ready) aio_submit(ready, cnt, src_name, true);
+        aio_submit();
         *io_error = true;
         return false;
       }
 
-      data->src_fd = src_fd;
-      data->dst_fd = dest_fd;
-      data->offset = offset;
-      data->buf_index = aio_buf_dequeue();
-      if (data->buf_index < 0)
-      {
-        fprintf(stderr, "error getting buffer from aio_buf_queue when reading %s\n", src_name);
-        aio_exit(true);
-      }
-      aio_buf[data->buf_index].iov_len = io_size;
-      data->is_read = true;
-      data->src_name = src_name;
-      data->dst_name = dst_name;
-      data->cnt = cnt;
-      data->all_read_submit = all_read_submit;
-      data->io_error = io_error;
+      // address the files by slot if copy_reg installed them
+      data->fixed_file = aio_file_lookup(src_fd, dest_fd,
+                                         &data->src_fd, &data->dst_fd);
+      data->file = NULL;
+      data->offset = offset;
+      data->len = io_size;
+
+      // out of buffer space: let inflight requests return some
+      while (aio_get_buf(data) < 0)
+      {
+        if (inflight == 0)
+        {
+          fprintf(stderr, "error getting buffer from aio_buf_queue when reading %s\n", src_name);
+          aio_exit(true);
+        }
+        aio_reap(aio_reap_nr());
+        if (*io_error)
+        {
+          free(data);
+          return false;
+        }
+      }
+      data->is_read = true;
+      data->src_name = src_name;
+      data->dst_name = dst_name;
+      data->submit_time = aio_now();
+      data->cnt = cnt;
+      data->all_read_submit = all_read_submit;
+      data->io_error = io_error;
+      data->linked = false;
+      data->hole_size = hole_size;
+      data->punch_holes = punch_holes;
+      data->falloc_mode = -1;
+
+      // the data must be looked at between the read and the write
+      if (aio_link && hole_size == 0)
+        aio_prep_link(data);
+      else
+        aio_prep_rw(data);
+
+      offset += io_size;
+      max_n_read -= io_size;
+      *total_n_read += io_size;
+    }
+
+    // the ring is full: submit prepared requests and reap completions,
+    // in one syscall per batch, until a chunk fits again
+    while (inflight + need > aio_depth)
+    {
+      aio_reap(aio_reap_nr());
+      if (*io_error) return false;
+    }
+  }
+
+  // keep small files batched with the next ones, unless a batch is
+  // complete or the device would otherwise sit idle
+  if (aio_sq_pending() >= AIO_REAP_BATCH
+      || aio_sq_pending() == inflight)
+    aio_submit();
+
+  return true;
+}
+
+/* Queue a fallocate with MODE of the N_BYTES at OFFSET of DEST_FD,
+   counted in CNT like the chunks of the file.
+   Return false if an I/O error stopped the copy of the file.  */
+static bool
+aio_fallocate (int src_fd, int dest_fd, int mode, off_t offset, off_t n_bytes,
+               char *src_name, char *dst_name, int *cnt,
+               bool *all_read_submit, bool *io_error)
+{
+  // without a ring, allocate right away
+  if (pio_engine)
+  {
+    int ret = 0;
+    if (mode == AIO_FALLOC_PUNCH)
+      ret = punch_hole(dest_fd, offset, n_bytes);
+#if HAVE_FALLOCATE + 0
+    else
+      ret = fallocate(dest_fd, mode, offset, n_bytes);
+#endif
+    if (ret == 0) return true;
+    *io_error = true;
+    aio_fail();
+    fprintf(stderr, "error %s %s: %s\n",
+            mode == AIO_FALLOC_PUNCH ? "deallocating" : "allocating",
+            dst_name, strerror(errno));
+    return false;
+  }
+
+  while (inflight + 1 > aio_depth)
+  {
+    aio_reap(aio_reap_nr());
+    if (*io_error) return false;
+  }
+
+  struct aio_data *data = (struct aio_data *)malloc(sizeof(struct aio_data));
+  if (data == NULL)
+  {
+    fprintf(stderr, "error allocating aio_data when allocating %s\n", dst_name);
+    *io_error = true;
+    return false;
+  }
+  data->fixed_file = aio_file_lookup(src_fd, dest_fd,
+                                     &data->src_fd, &data->dst_fd);
+  data->file = NULL;
+  data->offset = offset;
+  data->len = n_bytes;
+  data->buf_index = -1;
+  data->buf_off = 0;
+  data->seg_off = 0;
+  data->is_read = false;
+  data->src_name = src_name;
+  data->dst_name = dst_name;
+  data->submit_time = aio_now();
+  data->cnt = cnt;
+  data->all_read_submit = all_read_submit;
+  data->io_error = io_error;
+  data->linked = false;
+  data->hole_size = 0;
+  data->punch_holes = false;
+  data->falloc_mode = mode;
+  aio_prep_rw(data);
+  return true;
+}
+
+/* AIO utils: set the descriptor budget from RLIMIT_NOFILE */
+void aio_fd_init(const struct cp_options *options)
+{
+  struct rlimit rlim;
+  int budget = INT_MAX;
+  if (getrlimit(RLIMIT_NOFILE, &rlim) == 0 && rlim.rlim_cur != RLIM_INFINITY
+      && rlim.rlim_cur < INT_MAX)
+    budget = rlim.rlim_cur;
+  budget -= AIO_FD_RESERVE + 2 * options->walkers;
+
+  pthread_mutex_lock(&aio_pool_lock);
+  aio_fd_budget = MAX(2, budget);
+  pthread_mutex_unlock(&aio_pool_lock);
+}
+
+/* AIO utils: take N descriptors of the budget if they are available */
+bool aio_fd_take(int n)
+{
+  pthread_mutex_lock(&aio_pool_lock);
+  bool ok = aio_fd_used == 0 || aio_fd_used + n <= aio_fd_budget;
+  if (ok) aio_fd_used += n;
+  pthread_mutex_unlock(&aio_pool_lock);
+  return ok;
+}
+
+/* AIO utils: give back N descriptors of the budget */
+void aio_fd_release(int n)
+{
+  pthread_mutex_lock(&aio_pool_lock);
+  aio_fd_used -= n;
+  pthread_cond_broadcast(&aio_fd_freed);
+  pthread_mutex_unlock(&aio_pool_lock);
+}
+
+/* AIO utils: wait until N descriptors of the budget may be available
+   Our own requests in flight are reaped, since they may close files;
+   with none, wait for another engine to close some.  */
+void aio_fd_wait(int n)
+{
+  aio_stats.fd_waits++;
+  if (inflight > 0)
+  {
+    aio_reap(1);
+    return;
+  }
+  pthread_mutex_lock(&aio_pool_lock);
+  while (aio_fd_used && aio_fd_budget < aio_fd_used + n)
+    pthread_cond_wait(&aio_fd_freed, &aio_pool_lock);
+  pthread_mutex_unlock(&aio_pool_lock);
+}
+
+/* AIO utils: main loop of a worker engine */
+static void *aio_worker(void *arg)
+{
+  aio_self = (intptr_t)arg;
+  bool ok = aio_engine_init(aio_pool_options, aio_pool_options->threads + 1);
+  if (!ok)
+    fprintf(stderr, "warning: worker engine %d cannot start, leaving its files "
+            "to the others\n", aio_self);
+
+  // report to aio_pool_start, taking the next deque if we run
+  pthread_mutex_lock(&aio_pool_lock);
+  if (ok)
+    aio_self = aio_nworkers++;
+  aio_pool_reported++;
+  pthread_cond_broadcast(&aio_pool_idle);
+  pthread_mutex_unlock(&aio_pool_lock);
+  if (!ok)
+    return NULL;
+
+  while (true)
+  {
+    struct aio_file *file;
+    while (!aio_file_parked_head && inflight + 2 <= aio_depth
+           && (file = aio_file_admitting ? aio_file_admitting : aio_pool_take()))
+    {
+      aio_file_admitting = aio_file_admit(file) ? NULL : file;
+      if (aio_file_admitting)
+        break;
+      aio_file_begin(file);
+    }
+
+    if (aio_file_admitting)
+      aio_fd_wait(2);
+    else if (inflight > 0)
+      aio_reap(aio_reap_nr());
+    else if (aio_file_parked_head)
+    {
+      fprintf(stderr, "error getting buffer from aio_buf_queue when reading %s\n",
+              aio_file_parked_head->src_name);
+      aio_exit(true);
+    }
+    else
+    {
+      // nothing in flight: wait for files to be queued
+      aio_stats_merge();
+      pthread_mutex_lock(&aio_pool_lock);
+      aio_pool_idle_workers++;
+      pthread_cond_broadcast(&aio_pool_idle);
+      while (aio_pool_queued == 0 && !aio_pool_stopping)
+        pthread_cond_wait(&aio_pool_wake, &aio_pool_lock);
+      aio_pool_idle_workers--;
+      bool stop = aio_pool_queued == 0;
+      pthread_mutex_unlock(&aio_pool_lock);
+      if (stop)
+        break;
+    }
+  }
+
+  aio_stats_engine();
+  aio_stats_merge();
+  aio_exit(false);
+  return NULL;
+}
+
+/* AIO utils: start the worker engines of --threads
+   If no worker engine can be set up, files stay on this thread.  */
+void aio_pool_start(const struct cp_options *options)
+{
+  int n = options->threads;
+  aio_pool_options = options;
+  aio_pool_size = n;
+  aio_deques = xcalloc(n, sizeof *aio_deques);
+  for (int i = 0; i < n; i++)
+  {
+    pthread_mutex_init(&aio_deques[i].lock, NULL);
+    aio_deques[i].size = 64;
+    aio_deques[i].file = xnmalloc(aio_deques[i].size, sizeof *aio_deques[i].file);
+  }
+
+  aio_pool_threads = xnmalloc(n, sizeof *aio_pool_threads);
+  aio_pool_reported = 0;
+  while (aio_pool_nthreads < n
+         && pthread_create(&aio_pool_threads[aio_pool_nthreads], NULL,
+                           aio_worker, (void *)(intptr_t)aio_pool_nthreads) == 0)
+    aio_pool_nthreads++;
+
+  // no file may be handed out before the deques are numbered
+  pthread_mutex_lock(&aio_pool_lock);
+  while (aio_pool_reported < aio_pool_nthreads)
+    pthread_cond_wait(&aio_pool_idle, &aio_pool_lock);
+  aio_pool_limit = (size_t)aio_nworkers * AIO_POOL_AHEAD;
+  pthread_mutex_unlock(&aio_pool_lock);
+
+  if (aio_nworkers == 0)
+  {
+    fprintf(stderr, "warning: cannot start worker engines, copying on one\n");
+    aio_pool_stop();
+  }
+}
+
+/* AIO utils: stop the worker engines and wait for them to exit
+   The pool must be quiesced.  Each worker merges its statistics and
+   tears down its engine as it exits.  */
+void aio_pool_stop()
+{
+  pthread_mutex_lock(&aio_pool_lock);
+  aio_pool_stopping = true;
+  pthread_cond_broadcast(&aio_pool_wake);
+  pthread_mutex_unlock(&aio_pool_lock);
+  for (int i = 0; i < aio_pool_nthreads; i++)
+    pthread_join(aio_pool_threads[i], NULL);
+
+  for (int i = 0; i < aio_pool_size; i++)
+  {
+    pthread_mutex_destroy(&aio_deques[i].lock);
+    free(aio_deques[i].file);
+  }
+  free(aio_deques);
+  aio_deques = NULL;
+  free(aio_pool_threads);
+  aio_pool_threads = NULL;
+  aio_pool_nthreads = 0;
+  aio_pool_size = 0;
+
+  pthread_mutex_lock(&aio_pool_lock);
+  aio_nworkers = 0;
+  aio_pool_limit = 0;
+  aio_pool_next = 0;
+  aio_pool_stopping = false;
+  pthread_mutex_unlock(&aio_pool_lock);
+}
+
+/* AIO utils: queue FILE on the deque of worker TARGET */
+void aio_pool_push(struct aio_file *file, int target)
+{
+  struct aio_deque *dq = &aio_deques[target];
+  pthread_mutex_lock(&dq->lock);
+  if (dq->tail - dq->head == dq->size)
+  {
+    // grow the ring buffer, unwrapping it
+    struct aio_file **grown = xnmalloc(2 * dq->size, sizeof *grown);
+    for (size_t i = 0; i < dq->size; i++)
+      grown[i] = dq->file[(dq->head + i) & (dq->size - 1)];
+    free(dq->file);
+    dq->file = grown;
+    dq->tail -= dq->head;
+    dq->head = 0;
+    dq->size *= 2;
+  }
+  dq->file[dq->tail++ & (dq->size - 1)] = file;
+  pthread_mutex_unlock(&dq->lock);
+
+  pthread_mutex_lock(&aio_pool_lock);
+  aio_pool_queued++;
+  pthread_cond_broadcast(&aio_pool_wake);
+  pthread_mutex_unlock(&aio_pool_lock);
+}
+
+/* AIO utils: take the next file for this worker
+   Pop the newest file of our own deque, or steal the oldest file of
+   another worker's.  Return NULL if all deques are empty.  */
+struct aio_file *aio_pool_take()
+{
+  struct aio_file *file = NULL;
+  for (int i = 0; i < aio_nworkers && file == NULL; i++)
+  {
+    struct aio_deque *dq = &aio_deques[(aio_self + i) % aio_nworkers];
+    pthread_mutex_lock(&dq->lock);
+    if (dq->head != dq->tail)
+    {
+      if (i == 0)
+        file = dq->file[--dq->tail & (dq->size - 1)];
+      else
+      {
+        file = dq->file[dq->head++ & (dq->size - 1)];
+        aio_stats.steals++;
+      }
+    }
+    pthread_mutex_unlock(&dq->lock);
+  }
+
+  if (file)
+  {
+    pthread_mutex_lock(&aio_pool_lock);
+    aio_pool_queued--;
+    pthread_mutex_unlock(&aio_pool_lock);
+  }
+  return file;
+}
+
+/* AIO utils: hand FILE to a worker, round robin
+   Wait while aio_pool_limit files are handed out already.  */
+void aio_pool_submit(struct aio_file *file)
+{
+  pthread_mutex_lock(&aio_pool_lock);
+  while (aio_pool_limit <= aio_pool_pending)
+    pthread_cond_wait(&aio_pool_idle, &aio_pool_lock);
+  aio_pool_pending++;
+  int target = aio_pool_next++ % aio_nworkers;
+  pthread_mutex_unlock(&aio_pool_lock);
+  aio_pool_push(file, target);
+}
+
+/* AIO utils: a file or range handed to a worker is finished */
+void aio_pool_done()
+{
+  pthread_mutex_lock(&aio_pool_lock);
+  aio_pool_pending--;
+  if (aio_pool_pending == 0 || aio_pool_pending + 1 == aio_pool_limit)
+    pthread_cond_broadcast(&aio_pool_idle);
+  pthread_mutex_unlock(&aio_pool_lock);
+}
+
+/* AIO utils: wait until every file handed out is finished and all
+   workers are idle, with their statistics merged.  */
+void aio_pool_quiesce()
+{
+  pthread_mutex_lock(&aio_pool_lock);
+  while (aio_pool_pending || aio_pool_idle_workers < aio_nworkers)
+    pthread_cond_wait(&aio_pool_idle, &aio_pool_lock);
+  pthread_mutex_unlock(&aio_pool_lock);
+}
+
+/* AIO utils: queue a file-level request of FILE on SQE */
+static void
+aio_file_queue (struct aio_file *file, struct io_uring_sqe *sqe,
+                enum aio_file_op_kind kind)
+{
+  file->op[kind].file = file;
+  file->op[kind].kind = kind;
+  io_uring_sqe_set_data (sqe, (void *)((uintptr_t)&file->op[kind] | AIO_FILE_TAG));
+  file->pending++;
+  inflight++;
+}
+
+/* Start copying the regular file SRC_NAME to the new file DST_NAME
+   through the ring: queue the open and statx of the source, and
+   return.  The rest of the copy is driven by aio_file_proc_cqe.
+   Return false if the copy could not be queued; nothing is changed
+   then, and the caller should copy the file itself.  */
+bool
+aio_file_start (char const *src_name, char const *dst_name,
+                const struct cp_options *x, mode_t dst_mode,
+                struct stat const *src_sb)
+{
+  struct aio_file *file = calloc (1, sizeof *file);
+  char *src_name_clone = strdup (src_name);
+  char *dst_name_clone = strdup (dst_name);
+  if (file == NULL || src_name_clone == NULL || dst_name_clone == NULL)
+    {
+      free (file);
+      free (src_name_clone);
+      free (dst_name_clone);
+      return false;
+    }
+
+  file->src_name = src_name_clone;
+  file->dst_name = dst_name_clone;
+  file->src_flags = (O_RDONLY | O_BINARY
+                     | (x->dereference == DEREF_NEVER ? O_NOFOLLOW : 0));
+  file->stat_flags = x->dereference == DEREF_NEVER ? AT_SYMLINK_NOFOLLOW : 0;
+  file->dst_mode = dst_mode;
+  file->src_dev = src_sb->st_dev;
+  file->src_ino = src_sb->st_ino;
+  file->size = src_sb->st_size;
+  file->chunk.buf_index = -1;
+
+  pthread_mutex_lock (&aio_pool_lock);
+  aio_file_opening++;
+  pthread_mutex_unlock (&aio_pool_lock);
+  file->counted = true;
+
+  // hand the file to a worker engine, or run it on this thread's ring
+  if (aio_nworkers)
+    {
+      aio_pool_submit (file);
+      return true;
+    }
+
+  // keep the number of files in flight in check
+  while (aio_file_parked_head || aio_depth < inflight + 2)
+    {
+      if (inflight == 0)
+        {
+          fprintf (stderr, "error getting buffer from aio_buf_queue when reading %s\n",
+                   aio_file_parked_head->src_name);
+          aio_exit (true);
+        }
+      aio_reap (aio_reap_nr ());
+    }
+  while (! aio_file_admit (file))
+    aio_fd_wait (2);
+  aio_file_begin (file);
+  return true;
+}
+
+/* Reserve what FILE needs to be opened: two slots of this thread's
+   fixed-file table, or else two descriptors of the budget.  Return
+   false if neither is available right now.  */
+bool
+aio_file_admit (struct aio_file *file)
+{
+  file->fixed = aio_fixed_files && 2 <= aio_file_nfree;
+  if (file->fixed)
+    {
+      file->src_slot = aio_file_free[--aio_file_nfree];
+      file->dst_slot = aio_file_free[--aio_file_nfree];
+      return true;
+    }
+  file->fds_held = aio_fd_take (2);
+  return file->fds_held;
+}
+
+/* Queue the linked chain that copies the small FILE, which has fixed
+   slots reserved.  Return false if there is no buffer for it, or no
+   room for all of its requests.  */
+static bool
+aio_file_begin_small (struct aio_file *file)
+{
+  int n = file->size ? 7 : 5;
+
+  // admission only reserved the two requests of aio_file_begin
+  if (aio_depth < inflight + n)
+    return false;
+
+  // a chain must not be split across two submissions; with SQ polling,
+  // submitting does not free slots at once
+  if (io_uring_sq_space_left (&aio_ring) < (unsigned) n)
+    aio_submit ();
+  if (io_uring_sq_space_left (&aio_ring) < (unsigned) n)
+    return false;
+
+  file->chunk.len = file->size;
+  if (file->size && aio_get_buf (&file->chunk) < 0)
+    return false;
+
+  struct io_uring_sqe *sqe = io_uring_get_sqe (&aio_ring);
+  io_uring_prep_openat_direct (sqe, AT_FDCWD, file->src_name,
+                               file->src_flags, 0, file->src_slot);
+  io_uring_sqe_set_flags (sqe, IOSQE_IO_LINK);
+  aio_file_queue (file, sqe, AIO_FILE_OPEN_SRC);
+
+  sqe = io_uring_get_sqe (&aio_ring);
+  io_uring_prep_statx (sqe, AT_FDCWD, file->src_name, file->stat_flags,
+                       STATX_BASIC_STATS, &file->stx);
+  io_uring_sqe_set_flags (sqe, IOSQE_IO_LINK);
+  aio_file_queue (file, sqe, AIO_FILE_STATX);
+
+  sqe = io_uring_get_sqe (&aio_ring);
+  io_uring_prep_openat_direct (sqe, AT_FDCWD, file->dst_name,
+                               O_WRONLY | O_CREAT | O_EXCL | O_BINARY,
+                               file->dst_mode, file->dst_slot);
+  io_uring_sqe_set_flags (sqe, IOSQE_IO_LINK);
+  aio_file_queue (file, sqe, AIO_FILE_OPEN_DST);
+
+  if (file->size)
+    {
+      char *buf = AIO_BUF_ADDR (&file->chunk);
+      sqe = io_uring_get_sqe (&aio_ring);
+      aio_prep_buf_rw (sqe, true, file->src_slot, buf, file->size, 0,
+                       file->chunk.buf_index);
+      io_uring_sqe_set_flags (sqe, IOSQE_IO_LINK | IOSQE_FIXED_FILE);
+      aio_file_queue (file, sqe, AIO_FILE_READ);
+
+      sqe = io_uring_get_sqe (&aio_ring);
+      aio_prep_buf_rw (sqe, false, file->dst_slot, buf, file->size, 0,
+                       file->chunk.buf_index);
+      io_uring_sqe_set_flags (sqe, IOSQE_IO_LINK | IOSQE_FIXED_FILE);
+      aio_file_queue (file, sqe, AIO_FILE_WRITE);
+    }
+
+  sqe = io_uring_get_sqe (&aio_ring);
+  io_uring_prep_close_direct (sqe, file->dst_slot);
+  io_uring_sqe_set_flags (sqe, IOSQE_IO_LINK);
+  aio_file_queue (file, sqe, AIO_FILE_CLOSE_DST);
+
+  sqe = io_uring_get_sqe (&aio_ring);
+  io_uring_prep_close_direct (sqe, file->src_slot);
+  aio_file_queue (file, sqe, AIO_FILE_CLOSE_SRC);
+
+  file->small = true;
+  file->closing = true;
+  aio_stats.files++;
+  aio_stats.small_files++;
+  if (AIO_REAP_BATCH <= aio_sq_pending ())
+    aio_submit ();
+  return true;
+}
+
+/* Queue the first requests of FILE on this thread's ring: the open and
+   statx of the source, or for a range of a file being copied, the opens
+   of the source and of the existing destination.  FILE has been
+   admitted by aio_file_admit.  */
+void
+aio_file_begin (struct aio_file *file)
+{
+  file->src = file->dst = -1;
+
+  if (file->fixed && ! file->range && file->size <= AIO_SMALL_FILE
+      && aio_buf_mode != URING_BUFFERS_RING && aio_file_begin_small (file))
+    return;
+
+  struct io_uring_sqe *sqe = aio_get_sqe ();
+  if (file->fixed)
+    io_uring_prep_openat_direct (sqe, AT_FDCWD, file->src_name,
+                                 file->src_flags, 0, file->src_slot);
+  else
+    io_uring_prep_openat (sqe, AT_FDCWD, file->src_name, file->src_flags, 0);
+  aio_file_queue (file, sqe, AIO_FILE_OPEN_SRC);
+
+  sqe = aio_get_sqe ();
+  if (file->range)
+    {
+      if (file->fixed)
+        io_uring_prep_openat_direct (sqe, AT_FDCWD, file->dst_name,
+                                     O_WRONLY | O_BINARY, 0, file->dst_slot);
+      else
+        io_uring_prep_openat (sqe, AT_FDCWD, file->dst_name,
+                              O_WRONLY | O_BINARY, 0);
+      aio_file_queue (file, sqe, AIO_FILE_OPEN_DST);
+    }
+  else
+    {
+      io_uring_prep_statx (sqe, AT_FDCWD, file->src_name, file->stat_flags,
+                           STATX_BASIC_STATS, &file->stx);
+      aio_file_queue (file, sqe, AIO_FILE_STATX);
+      aio_stats.files++;
+    }
+
+  if (AIO_REAP_BATCH <= aio_sq_pending ())
+    aio_submit ();
+}
+
+/* Report an error about the file NAME.  This may run on any engine
+   thread, and quoteaf uses static buffers, so quote into a buffer of
+   our own.  */
+static void
+aio_file_error (int errnum, char const *format, char const *name)
+{
+  struct quoting_options o
+    = quoting_options_from_style (shell_escape_always_quoting_style);
+  char *quoted = quotearg_alloc (name, SIZE_MAX, &o);
+  error (0, errnum, format, quoted);
+  free (quoted);
+}
+
+/* The destination of FILE was created, or never will be.  */
+static void
+aio_file_created (struct aio_file *file)
+{
+  file->counted = false;
+  pthread_mutex_lock (&aio_pool_lock);
+  if (--aio_file_opening == 0)
+    pthread_cond_broadcast (&aio_pool_idle);
+  pthread_mutex_unlock (&aio_pool_lock);
+}
+
+/* Leave all of FILE but its first AIO_SPLIT_SIZE bytes to range jobs,
+   which idle workers steal from this thread's deque.  */
+static void
+aio_file_split (struct aio_file *file)
+{
+  off_t end = file->size;
+  off_t start = (end - 1) / AIO_SPLIT_SIZE * AIO_SPLIT_SIZE;
+
+  for (; AIO_SPLIT_SIZE <= start; end = start, start -= AIO_SPLIT_SIZE)
+    {
+      struct aio_file *part = calloc (1, sizeof *part);
+      char *src_name = strdup (file->src_name);
+      char *dst_name = strdup (file->dst_name);
+      if (part == NULL || src_name == NULL || dst_name == NULL)
+        {
+          // keep the rest of the file for ourselves
+          free (part);
+          free (src_name);
+          free (dst_name);
+          break;
+        }
+      part->src_name = src_name;
+      part->dst_name = dst_name;
+      part->src_flags = file->src_flags;
+      part->range = true;
+      part->offset = start;
+      part->size = end;
+      part->buf_size = file->buf_size;
+      part->counted = true;
+
+      pthread_mutex_lock (&aio_pool_lock);
+      aio_pool_pending++;
+      aio_file_opening++;
+      pthread_mutex_unlock (&aio_pool_lock);
+      aio_pool_push (part, aio_self);
+    }
+  file->size = end;
+}
+
+/* Add FILE, whose data phase starts, to the aio_file_parked list.  */
+static void
+aio_file_schedule (struct aio_file *file)
+{
+  file->sched_len = file->size - file->offset;
+  file->sched_time = aio_now ();
+
+  struct aio_file **link = &aio_file_parked_head;
+  struct aio_file *prev = NULL;
+  if (aio_sched == URING_SCHED_SRF)
+    while (*link && (*link)->size - (*link)->offset <= file->sched_len)
+      {
+        prev = *link;
+        link = &prev->next;
+      }
+  else
+    {
+      prev = aio_file_parked_tail;
+      link = prev ? &prev->next : &aio_file_parked_head;
+    }
+
+  file->next = *link;
+  *link = file;
+  if (file->next == NULL)
+    aio_file_parked_tail = file;
+}
+
+/* Check the statx of the small FILE, whose chain has completed.  If the
+   source grew since copy_internal stat'ed it, turn FILE into a range
+   job for the rest, to be queued again with aio_file_begin, and return
+   true.  */
+static bool
+aio_file_grown (struct aio_file *file)
+{
+  if (makedev (file->stx.stx_dev_major, file->stx.stx_dev_minor)
+      != file->src_dev
+      || file->stx.stx_ino != file->src_ino)
+    {
+      aio_file_error (0, _("%s was replaced while being copied"),
+                      file->src_name);
+      file->io_error = true;
+      return false;
+    }
+  if (file->stx.stx_size <= file->size)
+    return false;
+
+  aio_release_buf (&file->chunk);
+  file->small = false;
+  file->closing = false;
+  file->range = true;
+  file->offset = file->size;
+  file->size = file->stx.stx_size;
+  file->buf_size = MIN (AIO_BLKSIZE, MAX (IO_BUFSIZE, file->stx.stx_blksize));
+  return true;
+}
+
+/* Advance the copy of OP's file now that OP has completed.  */
+void
+aio_file_proc_cqe (struct io_uring_cqe *cqe, struct aio_file_op *op)
+{
+  struct aio_file *file = op->file;
+  int res = cqe->res;
+  file->pending--;
+
+  // cut off by the failure of an earlier request of the chain, which
+  // is reported on its own; a cancelled close leaves its file open
+  if (file->small && res == -ECANCELED)
+    file->io_error = true;
+  else switch (op->kind)
+    {
+    case AIO_FILE_OPEN_SRC:
+      if (res < 0)
+        {
+          aio_file_error (-res, _("cannot open %s for reading"),
+                          file->src_name);
+          file->io_error = true;
+        }
+      else
+        file->src = file->fixed ? file->src_slot : res;
+      break;
+
+    case AIO_FILE_STATX:
+      if (res < 0)
+        {
+          aio_file_error (-res, _("cannot fstat %s"), file->src_name);
+          file->io_error = true;
+        }
+      break;
+
+    case AIO_FILE_OPEN_DST:
+      if (res < 0)
+        {
+          aio_file_error (-res, file->range
+                          ? _("cannot open %s for writing")
+                          : _("cannot create regular file %s"),
+                          file->dst_name);
+          file->io_error = true;
+        }
+      else
+        file->dst = file->fixed ? file->dst_slot : res;
+      break;
+
+    case AIO_FILE_READ:
+      if (res != file->size)
+        {
+          aio_file_error (res < 0 ? -res : 0,
+                          res < 0 ? _("error reading %s")
+                          : _("%s: file shrank while being copied"),
+                          file->src_name);
+          file->io_error = true;
+        }
+      break;
+
+    case AIO_FILE_WRITE:
+      if (res != file->size)
+        {
+          aio_file_error (res < 0 ? -res : ENOSPC, _("error writing %s"),
+                          file->dst_name);
+          file->io_error = true;
+        }
+      break;
+
+    case AIO_FILE_CLOSE_SRC:
+      if (res < 0)
+        {
+          aio_file_error (-res, _("failed to close %s"), file->src_name);
+          file->io_error = true;
+        }
+      file->src = -1;
+      break;
+
+    case AIO_FILE_CLOSE_DST:
+      if (res < 0)
+        {
+          aio_file_error (-res, _("failed to close %s"), file->dst_name);
+          file->io_error = true;
+        }
+      file->dst = -1;
+      break;
+
+    default:
+      abort ();
+    }
+
+  if (file->pending)
+    return;
+
+  if (file->closing && (0 <= file->src || 0 <= file->dst))
+    aio_file_close (file);
+  else if (file->closing && file->small && ! file->io_error
+           && aio_file_grown (file))
+    aio_file_begin (file);
+  else if (file->closing)
+    aio_file_finish (file);
+  else if (file->io_error)
+    aio_file_close (file);
+  // source open and stat'ed: create the destination
+  else if (file->dst < 0)
+    {
+      if (makedev (file->stx.stx_dev_major, file->stx.stx_dev_minor)
+          != file->src_dev
+          || file->stx.stx_ino != file->src_ino)
+        {
+          aio_file_error (0, _("skipping file %s, as it was replaced while being copied"),
+                          file->src_name);
+          file->io_error = true;
+          aio_file_close (file);
+          return;
+        }
+
+      struct io_uring_sqe *sqe = aio_get_sqe ();
+      int dst_flags = O_WRONLY | O_CREAT | O_EXCL | O_BINARY;
+      if (file->fixed)
+        io_uring_prep_openat_direct (sqe, AT_FDCWD, file->dst_name,
+                                     dst_flags, file->dst_mode, file->dst_slot);
+      else
+        io_uring_prep_openat (sqe, AT_FDCWD, file->dst_name, dst_flags,
+                              file->dst_mode);
+      aio_file_queue (file, sqe, AIO_FILE_OPEN_DST);
+    }
+  // both files open: copy the data
+  else
+    {
+      if (! file->range)
+        {
+          // the same I/O unit copy_reg would start from, capped at a buffer
+          file->size = file->stx.stx_size;
+          file->buf_size = MIN (AIO_BLKSIZE,
+                                MAX (IO_BUFSIZE, file->stx.stx_blksize));
+          // a range job reopens the destination, so it must be writable
+          if (1 < aio_nworkers && (file->dst_mode & S_IWUSR))
+            aio_file_split (file);
+        }
+      // the destination exists, and so do those of the range jobs
+      if (file->counted)
+        aio_file_created (file);
+
+      aio_file_schedule (file);
+      aio_file_pump ();
+    }
+}
+
+/* Prepare the next chunk of FILE, without waiting for completions:
+   this also runs while CQEs are handled.  Return false if FILE has to
+   wait for more room.  */
+static bool
+aio_file_chunk (struct aio_file *file)
+{
+  if (aio_depth < inflight + (aio_link ? 2 : 1))
+    return false;
+
+  struct aio_data *data = malloc (sizeof *data);
+  if (data == NULL)
+    {
+      fprintf (stderr, "error allocating aio_data when reading %s\n",
+               file->src_name);
+      file->io_error = true;
+      return true;
+    }
+
+  data->len = aio_chunk_size (&aio_tuner, file->buf_size,
+                              file->size - file->offset);
+  if (aio_get_buf (data) < 0)
+    {
+      free (data);
+      return false;
+    }
+  data->src_fd = file->src;
+  data->dst_fd = file->dst;
+  data->fixed_file = file->fixed;
+  data->file = file;
+  data->offset = file->offset;
+  data->is_read = true;
+  data->src_name = file->src_name;
+  data->dst_name = file->dst_name;
+  data->submit_time = aio_now ();
+  data->cnt = &file->cnt;
+  data->all_read_submit = &file->all_read_submit;
+  data->io_error = &file->io_error;
+  data->linked = false;
+  data->hole_size = 0;
+  data->falloc_mode = -1;
+
+  if (aio_link)
+    aio_prep_link (data);
+  else
+    aio_prep_rw (data);
+  file->offset += data->len;
+  return true;
+}
+
+/* Prepare chunks of the parked files, in the order of aio_sched, as far
+   as room allows.  */
+void
+aio_file_pump (void)
+{
+  struct aio_file *file;
+
+  while ((file = aio_file_parked_head))
+    {
+      if (file->offset < file->size && ! file->io_error)
+        {
+          if (! aio_file_chunk (file))
+            break;
+          if (aio_sched == URING_SCHED_RR && file->next
+              && file->offset < file->size)
+            {
+              // to the back of the line
+              aio_file_parked_head = file->next;
+              file->next = NULL;
+              aio_file_parked_tail->next = file;
+              aio_file_parked_tail = file;
+            }
+          continue;
+        }
+
+      // all chunks prepared
+      aio_file_parked_head = file->next;
+      if (aio_file_parked_head == NULL)
+        aio_file_parked_tail = NULL;
+      file->all_read_submit = true;
+      if (file->cnt == 0)
+        aio_file_close (file);
+    }
+}
 
-      aio_prep_rw(data);
+/* Wait until every queued file has its destination created.  */
+void
+aio_file_settle (void)
+{
+  if (aio_nworkers)
+    {
+      pthread_mutex_lock (&aio_pool_lock);
+      while (aio_file_opening)
+        pthread_cond_wait (&aio_pool_idle, &aio_pool_lock);
+      pthread_mutex_unlock (&aio_pool_lock);
+    }
+  else
+    while (aio_file_opening)
+      aio_reap (1);
+}
 
-      offset += io_size;
-      max_n_read -= io_size;
-      *total_n_read += io_size;
-      ready++;
+/* Queue the close of whatever FILE has open.  */
+void
+aio_file_close (struct aio_file *file)
+{
+  struct io_uring_sqe *sqe;
+
+  file->closing = true;
+  if (0 <= file->src)
+    {
+      sqe = aio_get_sqe ();
+      if (file->fixed)
+        io_uring_prep_close_direct (sqe, file->src);
+      else
+        io_uring_prep_close (sqe, file->src);
+      aio_file_queue (file, sqe, AIO_FILE_CLOSE_SRC);
+    }
+  if (0 <= file->dst)
+    {
+      sqe = aio_get_sqe ();
+      if (file->fixed)
+        io_uring_prep_close_direct (sqe, file->dst);
+      else
+        io_uring_prep_close (sqe, file->dst);
+      aio_file_queue (file, sqe, AIO_FILE_CLOSE_DST);
     }
 
-    // submit prepared I/O requests
-    if (ready) aio_submit(ready, cnt, src_name, true);
+  if (file->pending == 0)
+    aio_file_finish (file);
+}
 
-    // process events from completed requests
-    if (inflight >= QD)
+/* Release FILE once nothing of it is in flight anymore.  */
+void
+aio_file_finish (struct aio_file *file)
+{
+  if (file->small)
+    aio_release_buf (&file->chunk);
+  if (file->fixed)
     {
-      struct io_uring_cqe *cqe;
-      struct aio_data *data;
-      bool write_comp = false;
-      while (1)
-      {
-        // use unblocked wait to get more available events
-        if (write_comp)
+      aio_file_free[aio_file_nfree++] = file->dst_slot;
+      aio_file_free[aio_file_nfree++] = file->src_slot;
+    }
+  if (file->fds_held)
+    aio_fd_release (2);
+  if (file->io_error)
+    aio_fail ();
+  else if (file->sched_time)
+    {
+      double t = aio_now () - file->sched_time;
+      if (file->sched_len <= AIO_SCHED_SMALL)
         {
-          ret = io_uring_peek_cqe(&aio_ring, &cqe);
-          if (ret == -EAGAIN) break;  // break the loop if no available events
+          aio_stats.sched_small++;
+          aio_stats.sched_small_time += t;
+          aio_stats.sched_small_max = MAX (aio_stats.sched_small_max, t);
         }
-        // use blocked wait to get at least one event
-        else
-          ret = io_uring_wait_cqe(&aio_ring, &cqe);
-
-        if (ret < 0)
+      else
         {
-          fprintf(stderr, "error getting completed I/O requests: %s\n", strerror(-ret));
-          aio_exit(true);
+          aio_stats.sched_large++;
+          aio_stats.sched_large_time += t;
+          aio_stats.sched_large_max = MAX (aio_stats.sched_large_max, t);
         }
-
-        aio_proc_cqe(cqe, &write_comp);
-        if (*io_error) return false;
-      }
     }
-  }
+  // the destination never will be created: its directory may be fixed up
+  if (file->counted)
+    aio_file_created (file);
 
-  return true;
+  free (file->src_name);
+  free (file->dst_name);
+  free (file);
+
+  if (aio_nworkers)
+    aio_pool_done ();
 }
 
 /* Perform the O(1) btrfs clone operation, if possible.
@@ -610,6 +3446,39 @@ clone_file (int dest_fd, int src_fd)
 #endif
 }
 
+/* Clone the LEN bytes at OFFSET of SRC_FD to the same offset of DEST_FD.
+   Upon success, return 0.  Otherwise, return -1 and set errno.  */
+static int
+clone_range (int dest_fd, int src_fd, off_t offset, off_t len)
+{
+#ifdef FICLONERANGE
+  struct file_clone_range range;
+  range.src_fd = src_fd;
+  range.src_offset = offset;
+  range.src_length = len;
+  range.dest_offset = offset;
+  return ioctl (dest_fd, FICLONERANGE, &range);
+#else
+  (void) dest_fd;
+  (void) src_fd;
+  (void) offset;
+  (void) len;
+  errno = ENOTSUP;
+  return -1;
+#endif
+}
+
+/* Return true if, FICLONE having failed with ERR, FICLONERANGE may still
+   clone some extents of the file: not if the file systems cannot share
+   data at all.  */
+static bool
+clone_by_extent (int err)
+{
+  return ! (err == EXDEV || is_ENOTSUP (err) || err == ENOTTY
+            || err == ENOSYS || err == EBADF || err == EPERM
+            || err == ETXTBSY);
+}
+
 /* Write N_BYTES zero bytes to file descriptor FD.  Return true if successful.
    Upon write failure, set errno and return false.  */
 static bool
@@ -643,17 +3512,62 @@ write_zeros (int fd, off_t n_bytes)
   return true;
 }
 
+/* Make the N_BYTES at OFFSET of DEST_FD read as zeros without writing
+   them, by allocating them with a fallocate queued to the ring: like an
+   unwritten extent of the source, the range then takes space but no
+   I/O.  *ALLOCATE is -1 until the first call for DEST_FD, which
+   allocates synchronously to find out whether the file system can; if
+   not, it becomes false and zeros are written instead.  */
+static bool
+allocate_zeros (int src_fd, int dest_fd, off_t offset, off_t n_bytes,
+                int *allocate, char *src_name, char *dst_name,
+                int *cnt, bool *all_read_submit, bool *io_error)
+{
+  if (n_bytes == 0)
+    return true;
+
+  if (*allocate < 0)
+    {
+#if HAVE_FALLOCATE + 0
+      *allocate = fallocate (dest_fd, 0, offset, n_bytes) == 0;
+      if (*allocate)
+        return true;
+      if (! (is_ENOTSUP (errno) || errno == ENOSYS || errno == EINVAL))
+        {
+          error (0, errno, _("error allocating %s"), quoteaf (dst_name));
+          return false;
+        }
+#else
+      *allocate = false;
+#endif
+    }
+
+  if (*allocate)
+    return aio_fallocate (src_fd, dest_fd, 0, offset, n_bytes, src_name,
+                          dst_name, cnt, all_read_submit, io_error);
+
+  if (lseek (dest_fd, offset, SEEK_SET) < 0 || ! write_zeros (dest_fd, n_bytes))
+    {
+      error (0, errno, _("%s: write failed"), quotef (dst_name));
+      return false;
+    }
+  return true;
+}
+
 /* Perform an efficient extent copy, if possible.  This avoids
    the overhead of detecting holes in hole-introducing/preserving
    copy, and thus makes copying sparse files much more efficient.
+   Find the extents with SCAN_METHOD; only FIEMAP reports unwritten
+   ones, which are allocated in the destination, not read.
    Upon a successful copy, return true.  If the initial extent scan
    fails, set *NORMAL_COPY_REQUIRED to true and return false.
    Upon any other failure, set *NORMAL_COPY_REQUIRED to false and
    return false.  */
 static bool
-extent_copy (int src_fd, int dest_fd,
+extent_copy (int src_fd, int dest_fd, size_t buf_size,
              size_t hole_size, off_t src_total_size,
-             enum Sparse_type sparse_mode,
+             enum Sparse_type sparse_mode, size_t extent_batch,
+             enum extent_scan_method scan_method,
              char *src_name, char *dst_name,
              bool *require_normal_copy,
              int *cnt, bool *all_read_submit, bool *io_error)
@@ -661,17 +3575,25 @@ extent_copy (int src_fd, int dest_fd,
   struct extent_scan scan;
   off_t last_ext_start = 0;
   off_t last_ext_len = 0;
+  int allocate = -1;
 
   /* Keep track of the output position.
      We may need this at the end, for a final ftruncate.  */
   off_t dest_pos = 0;
 
   extent_scan_init (src_fd, &scan);
+  scan.batch = extent_batch;
+  scan.method = scan_method;
 
   *require_normal_copy = false;
   bool wrote_hole_at_eof = true;
   do
     {
+      /* Let the device work on the extents queued so far while the
+         next batch is looked up.  */
+      if (aio_sq_pending())
+        aio_submit();
+
       bool ok = extent_scan_read (&scan);
       if (! ok)
         {
@@ -728,9 +3650,12 @@ extent_copy (int src_fd, int dest_fd,
 
           if (ext_hole_size)
             {
-              if (lseek (src_fd, ext_start, SEEK_SET) < 0)
+              /* Reads and writes go through the ring at explicit offsets
+                 and leave the destination's file offset alone, so put it
+                 where the hole starts.  */
+              if (lseek (dest_fd, ext_start - ext_hole_size, SEEK_SET) < 0)
                 {
-                  error (0, errno, _("cannot lseek %s"), quoteaf (src_name));
+                  error (0, errno, _("cannot lseek %s"), quoteaf (dst_name));
                 fail:
                   extent_scan_free (&scan);
                   return false;
@@ -739,9 +3664,15 @@ extent_copy (int src_fd, int dest_fd,
               if ((empty_extent && sparse_mode == SPARSE_ALWAYS)
                   || (!empty_extent && sparse_mode != SPARSE_NEVER))
                 {
-                  if (! create_hole (dest_fd, dst_name,
-                                     sparse_mode == SPARSE_ALWAYS,
-                                     ext_hole_size))
+                  if (! create_hole (dest_fd, dst_name, false, ext_hole_size))
+                    goto fail;
+                  /* Undo any preallocation, as create_hole would,
+                     through the ring.  */
+                  if (sparse_mode == SPARSE_ALWAYS
+                      && ! aio_fallocate (src_fd, dest_fd, AIO_FALLOC_PUNCH,
+                                          ext_start - ext_hole_size,
+                                          ext_hole_size, src_name, dst_name,
+                                          cnt, all_read_submit, io_error))
                     goto fail;
                   wrote_hole_at_eof = true;
                 }
@@ -749,17 +3680,16 @@ extent_copy (int src_fd, int dest_fd,
                 {
                   /* When not inducing holes and when there is a hole between
                      the end of the previous extent and the beginning of the
-                     current one, write zeros to the destination file.  */
+                     current one, allocate zeros in the destination file.  */
                   off_t nzeros = ext_hole_size;
                   if (empty_extent)
                     nzeros = MIN (src_total_size - dest_pos, ext_hole_size);
 
-                  if (! write_zeros (dest_fd, nzeros))
-                    {
-                      error (0, errno, _("%s: write failed"),
-                             quotef (dst_name));
-                      goto fail;
-                    }
+                  if (! allocate_zeros (src_fd, dest_fd,
+                                        ext_start - ext_hole_size, nzeros,
+                                        &allocate, src_name, dst_name,
+                                        cnt, all_read_submit, io_error))
+                    goto fail;
 
                   dest_pos = MIN (src_total_size, ext_start);
                 }
@@ -769,11 +3699,10 @@ extent_copy (int src_fd, int dest_fd,
 
           /* Treat an unwritten but allocated extent much like a hole.
              I.e., don't read, but don't convert to a hole in the destination,
-             unless SPARSE_ALWAYS.  */
-          /* For now, do not treat FIEMAP_EXTENT_UNWRITTEN specially,
-             because that (in combination with no sync) would lead to data
-             loss at least on XFS and ext4 when using 2.6.39-rc3 kernels.  */
-          if (0 && (scan.ext_info[i].ext_flags & FIEMAP_EXTENT_UNWRITTEN))
+             unless SPARSE_ALWAYS: it is allocated with the hole after it.
+             This is safe as FIEMAP is always asked to sync the file (see
+             extent_need_sync); SEEK_DATA reports such extents as holes.  */
+          if (scan.ext_info[i].ext_flags & FIEMAP_EXTENT_UNWRITTEN)
             {
               empty_extent = true;
               last_ext_len = 0;
@@ -787,10 +3716,10 @@ extent_copy (int src_fd, int dest_fd,
               last_ext_len = ext_len;
               bool read_hole;
 
-              if ( ! sparse_copy (src_fd, dest_fd,
+              if ( ! sparse_copy (src_fd, dest_fd, buf_size,
                                   sparse_mode == SPARSE_ALWAYS ? hole_size: 0,
                                   true, src_name, dst_name, ext_len, &n_read,
-                                  dest_pos, cnt, all_read_submit, io_error,
+                                  ext_start, cnt, all_read_submit, io_error,
                                   &read_hole))
                 goto fail;
 
@@ -825,22 +3754,260 @@ extent_copy (int src_fd, int dest_fd,
      In addition, if the final extent was a block of zeros at EOF and we've
      just converted them to a hole in the destination, we must call ftruncate
      here in order to record the proper length in the destination.  */
-  if ((dest_pos < src_total_size || wrote_hole_at_eof)
-      && (sparse_mode != SPARSE_NEVER
-          ? ftruncate (dest_fd, src_total_size)
-          : ! write_zeros (dest_fd, src_total_size - dest_pos)))
+  if (sparse_mode == SPARSE_NEVER)
+    {
+      if (! allocate_zeros (src_fd, dest_fd, dest_pos,
+                            src_total_size - dest_pos, &allocate, src_name,
+                            dst_name, cnt, all_read_submit, io_error))
+        return false;
+    }
+  else if ((dest_pos < src_total_size || wrote_hole_at_eof)
+           && ftruncate (dest_fd, src_total_size) < 0)
     {
       error (0, errno, _("failed to extend %s"), quoteaf (dst_name));
       return false;
     }
 
   if (sparse_mode == SPARSE_ALWAYS && dest_pos < src_total_size
-      && punch_hole (dest_fd, dest_pos, src_total_size - dest_pos) < 0)
+      && ! aio_fallocate (src_fd, dest_fd, AIO_FALLOC_PUNCH, dest_pos,
+                          src_total_size - dest_pos, src_name, dst_name,
+                          cnt, all_read_submit, io_error))
+    return false;
+
+  return true;
+}
+
+/* Extent clones
+   When FICLONE cannot clone a whole file, clone_copy clones it extent
+   by extent with FICLONERANGE, and copies only the extents that do not
+   clone (unaligned tails, ranges that cannot be shared) through the
+   ring.  Extents come from FIEMAP, split wherever their flags change
+   (inline data, unwritten, shared), where a SEEK_DATA range would span
+   extents that clone differently.  They are cloned one after another:
+   every FICLONERANGE into a file takes its inode lock, so the clones of
+   one file would not run in parallel anyway.  The reads and writes of
+   extents that did not clone go on in the ring meanwhile.  */
+struct clone_job
+{
+  off_t offset;
+  off_t len;
+};
+
+/* Clone the N_JOBS extents of JOBS from SRC_FD to DEST_FD, and copy
+   those that fail through the ring, or with ALWAYS, fail.  Arguments
+   and return value as for clone_copy.  */
+static bool
+clone_batch (int src_fd, int dest_fd, struct clone_job const *jobs,
+             size_t n_jobs, size_t buf_size, bool always, char *src_name,
+             char *dst_name, int *cnt, bool *all_read_submit, bool *io_error)
+{
+  for (size_t i = 0; i < n_jobs; i++)
+    {
+      struct clone_job const *job = &jobs[i];
+      if (clone_range (dest_fd, src_fd, job->offset, job->len) == 0)
+        {
+          aio_stats.clones++;
+          continue;
+        }
+      if (always)
+        {
+          error (0, errno, _("failed to clone %s from %s"),
+                 quoteaf_n (0, dst_name), quoteaf_n (1, src_name));
+          return false;
+        }
+
+      off_t n_read;
+      bool read_hole;
+      aio_stats.clone_copies++;
+      if (! sparse_copy (src_fd, dest_fd, buf_size, 0, false, src_name,
+                         dst_name, job->len, &n_read, job->offset, cnt,
+                         all_read_submit, io_error, &read_hole))
+        return false;
+    }
+  return true;
+}
+
+/* Copy SRC_FD to DEST_FD extent by extent: clone every extent that
+   FICLONERANGE accepts, and copy the others through the ring, unless
+   ALWAYS, when they are errors.  Holes stay holes.
+   Return values as for extent_copy.  */
+static bool
+clone_copy (int src_fd, int dest_fd, size_t buf_size, off_t src_total_size,
+            bool always, size_t extent_batch, char *src_name, char *dst_name,
+            bool *require_normal_copy, int *cnt, bool *all_read_submit,
+            bool *io_error)
+{
+  struct extent_scan scan;
+
+  extent_scan_init (src_fd, &scan);
+  scan.batch = extent_batch;
+  scan.method = EXTENT_SCAN_FIEMAP;
+
+  *require_normal_copy = false;
+  do
+    {
+      /* Let the device work on the extents queued so far while the
+         next batch is looked up and cloned.  */
+      if (aio_sq_pending())
+        aio_submit();
+
+      if (! extent_scan_read (&scan))
+        {
+          if (scan.hit_final_extent)
+            break;
+
+          if (scan.initial_scan_failed && ! always)
+            {
+              *require_normal_copy = true;
+              return false;
+            }
+
+          error (0, errno, _("%s: failed to get extents info"),
+                 quotef (src_name));
+          return false;
+        }
+
+      size_t n_jobs = 0;
+      struct clone_job *jobs = xnmalloc (MAX (1, scan.ei_count), sizeof *jobs);
+      for (size_t i = 0; i < scan.ei_count; i++)
+        {
+          off_t ext_start = scan.ext_info[i].ext_logical;
+          off_t ext_len = scan.ext_info[i].ext_length;
+
+          /* Stop at EOF, as extent_copy does.  */
+          if (src_total_size <= ext_start)
+            {
+              scan.hit_final_extent = true;
+              break;
+            }
+          jobs[n_jobs].offset = ext_start;
+          jobs[n_jobs].len = MIN (ext_len, src_total_size - ext_start);
+          n_jobs++;
+        }
+      extent_scan_free (&scan);
+
+      bool ok = clone_batch (src_fd, dest_fd, jobs, n_jobs, buf_size, always,
+                             src_name, dst_name, cnt, all_read_submit,
+                             io_error);
+      free (jobs);
+      if (! ok)
+        return false;
+    }
+  while (! scan.hit_final_extent);
+
+  /* The file may end with a hole.  */
+  if (ftruncate (dest_fd, src_total_size) < 0)
+    {
+      error (0, errno, _("failed to extend %s"), quoteaf (dst_name));
+      return false;
+    }
+
+  return true;
+}
+
+/* copy_file_range engine
+   With --copy-file-range, a regular file of more than AIO_SPLIT_SIZE
+   bytes is copied with copy_file_range instead of through the ring, so
+   that the kernel moves the data itself, by a server-side copy on NFS
+   or SMB or an in-kernel splice, and none of it passes through our
+   buffers.  The file is cut into ranges of AIO_SPLIT_SIZE bytes, which
+   the copying thread and N - 1 helpers take in turn.  */
+struct range_copy
+{
+  pthread_mutex_t lock;
+  int src_fd;
+  int dest_fd;
+  off_t size;
+  off_t next;                   /* start of the next range to take */
+  int err;                      /* errno of the first failure, or 0 */
+  bool short_copy;              /* a copy returned 0 before the end */
+};
+
+static void *
+range_copy_thread (void *arg)
+{
+  struct range_copy *rc = arg;
+
+  while (true)
+    {
+      pthread_mutex_lock (&rc->lock);
+      off_t start = rc->next;
+      bool stop = rc->err || rc->short_copy || rc->size <= start;
+      if (! stop)
+        rc->next = MIN (rc->size, start + AIO_SPLIT_SIZE);
+      off_t end = rc->next;
+      pthread_mutex_unlock (&rc->lock);
+      if (stop)
+        return NULL;
+
+      off_t in = start;
+      off_t out = start;
+      while (in < end)
+        {
+          ssize_t n = copy_file_range (rc->src_fd, &in, rc->dest_fd, &out,
+                                       end - in, 0);
+          if (0 < n)
+            continue;
+
+          /* Some file systems report 0 bytes copied rather than an
+             error, and the file may have shrunk: let the ring copy.  */
+          int err = n < 0 ? errno : 0;
+          pthread_mutex_lock (&rc->lock);
+          if (n == 0)
+            rc->short_copy = true;
+          else if (! rc->err)
+            rc->err = err;
+          pthread_mutex_unlock (&rc->lock);
+          return NULL;
+        }
+    }
+}
+
+/* Copy the SIZE bytes of SRC_FD to DEST_FD with copy_file_range, on
+   N_THREADS threads including this one.  Return true if successful.
+   If copy_file_range cannot copy between these files, set
+   *NORMAL_COPY_REQUIRED to true and return false; the destination may
+   then hold part of the data.  Upon any other failure, set
+   *NORMAL_COPY_REQUIRED to false and return false.  */
+static bool
+range_copy (int src_fd, int dest_fd, off_t size, size_t n_threads,
+            char const *src_name, char const *dst_name,
+            bool *normal_copy_required)
+{
+  struct range_copy rc;
+  pthread_mutex_init (&rc.lock, NULL);
+  rc.src_fd = src_fd;
+  rc.dest_fd = dest_fd;
+  rc.size = size;
+  rc.next = 0;
+  rc.err = 0;
+  rc.short_copy = false;
+
+  pthread_t *threads = xnmalloc (n_threads, sizeof *threads);
+  size_t started = 0;
+  while (started + 1 < n_threads
+         && pthread_create (&threads[started], NULL, range_copy_thread,
+                            &rc) == 0)
+    started++;
+  range_copy_thread (&rc);
+  for (size_t i = 0; i < started; i++)
+    pthread_join (threads[i], NULL);
+  free (threads);
+  pthread_mutex_destroy (&rc.lock);
+
+  *normal_copy_required = (rc.short_copy || rc.err == EXDEV
+                           || is_ENOTSUP (rc.err) || rc.err == ENOSYS
+                           || rc.err == EINVAL || rc.err == EBADF
+                           || rc.err == ETXTBSY);
+  if (rc.short_copy || rc.err)
     {
-      error (0, errno, _("error deallocating %s"), quoteaf (dst_name));
+      if (! *normal_copy_required)
+        error (0, rc.err, _("error copying %s to %s"),
+               quoteaf_n (0, src_name), quoteaf_n (1, dst_name));
       return false;
     }
 
+  aio_stats.range_files++;
   return true;
 }
 
@@ -962,6 +4129,121 @@ copy_attr (char const *src_path _GL_UNUSED,
 }
 #endif /* USE_XATTR */
 
+/* An entry of a directory being copied, and its sort key.  */
+struct dir_entry
+{
+  char const *name;
+  uintmax_t key;
+  size_t index;                 /* position in the savedir order */
+};
+
+static int
+dir_entry_compare (void const *a, void const *b)
+{
+  struct dir_entry const *x = a;
+  struct dir_entry const *y = b;
+  if (x->key != y->key)
+    return x->key < y->key ? -1 : 1;
+  return x->index < y->index ? -1 : x->index > y->index;
+}
+
+/* Return the physical address of the first extent of the regular file
+   NAME in the directory DIR_FD, as FIEMAP reports it, or UINTMAX_MAX - 1
+   if the file has no mapped extent or the address cannot be found.
+   Only one extent is asked for, so this is cheaper than extent_scan_read,
+   whose struct extent_info does not carry the physical address anyway.
+   The caller accounts for the descriptor this opens in the budget.  */
+
+static uintmax_t
+first_physical (int dir_fd, char const *name, int flags)
+{
+  uintmax_t physical = UINTMAX_MAX - 1;
+#ifdef __linux__
+  int fd = openat (dir_fd, name,
+                   (O_RDONLY | O_NOCTTY | O_CLOEXEC
+                    | (flags & AT_SYMLINK_NOFOLLOW ? O_NOFOLLOW : 0)));
+  if (fd < 0)
+    return physical;
+
+  union { struct fiemap f; char c[sizeof (struct fiemap)
+                                  + sizeof (struct fiemap_extent)]; } buf;
+  memset (&buf, 0, sizeof buf);
+  buf.f.fm_length = FIEMAP_MAX_OFFSET;
+  buf.f.fm_extent_count = 1;
+  if (ioctl (fd, FS_IOC_FIEMAP, &buf.f) == 0 && buf.f.fm_mapped_extents
+      && ! (buf.f.fm_extents[0].fe_flags & FIEMAP_EXTENT_UNKNOWN))
+    physical = buf.f.fm_extents[0].fe_physical;
+  close (fd);
+#endif
+  return physical;
+}
+
+/* Reorder the names in NAME_SPACE, as returned by savedir for the
+   directory DIR, according to X->order.  With COPY_ORDER_SIZE, regular
+   files come first, largest first, so that the longest copies start
+   early and the small files fill in around them.  With
+   COPY_ORDER_PHYSICAL, regular files come first in the order of their
+   first block on the source device, so that reads sweep the disk
+   instead of seeking back and forth.  Other entries follow in their
+   original order; entries that cannot be stat'ed count as not regular.
+   The walkers have usually stat'ed the entries already, so sorting by
+   size costs no I/O.  */
+
+static void
+sort_dir_entries (char const *dir, char *name_space,
+                  const struct cp_options *x)
+{
+  size_t n = 0;
+  for (char *namep = name_space; *namep; namep += strlen (namep) + 1)
+    n++;
+  if (n < 2)
+    return;
+
+  /* The directory and the entry being probed are open together; take
+     both descriptors out of the budget shared with the files in flight,
+     so that sorting under many engines cannot run into EMFILE.  */
+  while (! aio_fd_take (2))
+    aio_fd_wait (2);
+
+  int dir_fd = open (dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dir_fd < 0)
+    {
+      aio_fd_release (2);
+      return;
+    }
+
+  int flags = x->dereference == DEREF_ALWAYS ? 0 : AT_SYMLINK_NOFOLLOW;
+  struct dir_entry *entries = xnmalloc (n, sizeof *entries);
+  size_t i = 0;
+  for (char *namep = name_space; *namep; namep += strlen (namep) + 1, i++)
+    {
+      struct stat st;
+      entries[i].name = namep;
+      entries[i].index = i;
+      entries[i].key = UINTMAX_MAX;
+      if (fstatat (dir_fd, namep, &st, flags) == 0 && S_ISREG (st.st_mode))
+        entries[i].key = (x->order == COPY_ORDER_PHYSICAL
+                          ? first_physical (dir_fd, namep, flags)
+                          : UINTMAX_MAX - 1 - st.st_size);
+    }
+  close (dir_fd);
+  aio_fd_release (2);
+
+  qsort (entries, n, sizeof *entries, dir_entry_compare);
+
+  size_t size = 0;
+  for (i = 0; i < n; i++)
+    size += strlen (entries[i].name) + 1;
+  char *sorted = xmalloc (size);
+  char *p = sorted;
+  for (i = 0; i < n; i++)
+    p = stpcpy (p, entries[i].name) + 1;
+  memcpy (name_space, sorted, size);
+
+  free (sorted);
+  free (entries);
+}
+
 /* Read the contents of the directory SRC_NAME_IN, and recursively
    copy the contents to DST_NAME_IN.  NEW_DST is true if
    DST_NAME_IN is a directory that was created previously in the
@@ -986,7 +4268,7 @@ copy_dir (char const *src_name_in, char const *dst_name_in, bool new_dst,
   struct cp_options non_command_line_options = *x;
   bool ok = true;
 
-  name_space = savedir (src_name_in, SAVEDIR_SORT_FASTREAD);
+  name_space = walk_take (src_name_in);
   if (name_space == NULL)
     {
       /* This diagnostic is a bit vague because savedir can fail in
@@ -995,6 +4277,9 @@ copy_dir (char const *src_name_in, char const *dst_name_in, bool new_dst,
       return false;
     }
 
+  if (x->order != COPY_ORDER_DIRECTORY)
+    sort_dir_entries (src_name_in, name_space, x);
+
   /* For cp's -H option, dereference command line arguments, but do not
      dereference symlinks that are found via recursive traversal.  */
   if (x->dereference == DEREF_COMMAND_LINE_ARGUMENTS)
@@ -1028,6 +4313,7 @@ copy_dir (char const *src_name_in, char const *dst_name_in, bool new_dst,
       namep += strlen (namep) + 1;
     }
   free (name_space);
+  walk_finish (src_name_in);
   *first_dir_created_per_command_line_arg = new_first_dir_created;
 
   return ok;
@@ -1268,6 +4554,30 @@ is_probably_sparse (struct stat const *sb)
           && ST_NBLOCKS (*sb) < sb->st_size / ST_NBLOCKSIZE);
 }
 
+/* Files of at least this size are checked for unwritten extents.  */
+#define UNWRITTEN_MIN_SIZE (16 * 1024 * 1024)
+
+/* Return true if the file SB, open on FD, looks preallocated: it has
+   unwritten extents, whose zeros extent_copy allocates in the
+   destination instead of reading them.  Smaller files are not checked,
+   to spare them the ioctl.  SEEK_HOLE reports unwritten extents as
+   holes, so a file with no hole before its end needs no FIEMAP walk;
+   most large files are settled by that one lseek.  FD is left at
+   offset 0.  */
+static bool
+has_unwritten_extents (int fd, struct stat const *sb)
+{
+  if (! (S_ISREG (sb->st_mode) && UNWRITTEN_MIN_SIZE <= sb->st_size))
+    return false;
+#ifdef SEEK_HOLE
+  off_t hole = lseek (fd, 0, SEEK_HOLE);
+  lseek (fd, 0, SEEK_SET);
+  if (0 <= hole && sb->st_size <= hole)
+    return false;
+#endif
+  return extent_scan_unwritten (fd);
+}
+
 
 /* Copy a regular file from SRC_NAME to DST_NAME.
    If the source file contains holes, copies holes and blocks of zeros
@@ -1317,6 +4627,7 @@ copy_reg (char const *src_name, char const *dst_name,
   strcpy(dst_name_clone, dst_name);
 
   bool aio_start = false;
+  bool fixed_files = false;
   int *cnt = NULL;
   bool *all_read_submit = NULL;
   bool *io_error = NULL;
@@ -1340,12 +4651,23 @@ copy_reg (char const *src_name, char const *dst_name,
   *all_read_submit = false;
   *io_error = false;
 
+  /* Take the descriptors out of the budget shared with the files in
+     flight, waiting for some of those to close if need be.  */
+  while (! aio_fd_take (2))
+    aio_fd_wait (2);
+
   source_desc = open (src_name,
                       (O_RDONLY | O_BINARY
                        | (x->dereference == DEREF_NEVER ? O_NOFOLLOW : 0)));
   if (source_desc < 0)
     {
       error (0, errno, _("cannot open %s for reading"), quoteaf (src_name));
+      aio_fd_release (2);
+      free (cnt);
+      free (all_read_submit);
+      free (io_error);
+      free (src_name_clone);
+      free (dst_name_clone);
       return false;
     }
 
@@ -1517,10 +4839,14 @@ copy_reg (char const *src_name, char const *dst_name,
     }
 
   /* --attributes-only overrides --reflink.  */
+  bool clone_extents = false;
   if (data_copy_required && x->reflink_mode)
     {
       bool clone_ok = clone_file (dest_desc, source_desc) == 0;
-      if (clone_ok || x->reflink_mode == REFLINK_ALWAYS)
+
+      /* Some extents may clone even if the whole file does not.  */
+      clone_extents = ! clone_ok && clone_by_extent (errno);
+      if (clone_ok || (x->reflink_mode == REFLINK_ALWAYS && ! clone_extents))
         {
           if (!clone_ok)
             {
@@ -1537,9 +4863,12 @@ copy_reg (char const *src_name, char const *dst_name,
     {
       bool ok;
 
-      /* Choose a suitable buffer size; it may be adjusted later.  */
-      // size_t buf_alignment = getpagesize ();
-      // size_t buf_size = io_blksize (sb);
+      fixed_files = aio_file_register_pair (source_desc, dest_desc);
+
+      /* Choose a suitable I/O unit; it may be adjusted later.
+         The size of each request is a multiple of it, picked at
+         runtime by aio_chunk_size.  */
+      size_t buf_size = io_blksize (sb);
       size_t hole_size = ST_BLKSIZE (sb);
 
       fdadvise (source_desc, 0, 0, FADVISE_SEQUENTIAL);
@@ -1547,6 +4876,7 @@ copy_reg (char const *src_name, char const *dst_name,
       /* Deal with sparse files.  */
       bool make_holes = false;
       bool sparse_src = is_probably_sparse (&src_open_sb);
+      bool unwritten_src = has_unwritten_extents (source_desc, &src_open_sb);
 
       if (S_ISREG (sb.st_mode))
         {
@@ -1563,44 +4893,84 @@ copy_reg (char const *src_name, char const *dst_name,
             make_holes = true;
         }
 
-      // /* If not making a sparse file, try to use a more-efficient
-      //    buffer size.  */
-      // if (! make_holes)
-      //   {
-      //     /* Compute the least common multiple of the input and output
-      //        buffer sizes, adjusting for outlandish values.  */
-      //     size_t blcm_max = MIN (SIZE_MAX, SSIZE_MAX) - buf_alignment;
-      //     size_t blcm = buffer_lcm (io_blksize (src_open_sb), buf_size,
-      //                               blcm_max);
+      /* If not making a sparse file, try to use a more-efficient
+         I/O unit.  */
+      if (! make_holes)
+        {
+          /* Compute the least common multiple of the input and output
+             buffer sizes, adjusting for outlandish values.  Requests
+             never exceed one AIO buffer, so neither may the unit.  */
+          size_t blcm_max = AIO_BLKSIZE;
+          size_t blcm = buffer_lcm (io_blksize (src_open_sb), buf_size,
+                                    blcm_max);
+
+          /* Stick with a unit that is a positive multiple of blcm.  */
+          buf_size += blcm - 1;
+          buf_size -= buf_size % blcm;
+          if (buf_size == 0 || blcm_max < buf_size)
+            buf_size = blcm;
+        }
+
+      if (clone_extents)
+        {
+          bool normal_copy_required;
+
+          /* Clone what can be cloned, and copy the rest; fall back to
+             the copies below only if the initial extent scan fails.  */
+          aio_start = true;
+          ok = clone_copy (source_desc, dest_desc, buf_size,
+                           src_open_sb.st_size,
+                           x->reflink_mode == REFLINK_ALWAYS,
+                           x->extent_batch, src_name_clone, dst_name_clone,
+                           &normal_copy_required, cnt, all_read_submit,
+                           io_error);
+          if (*cnt == 0) aio_start = false;
+          else if (ok || !normal_copy_required) *all_read_submit = true;
 
-      //     /* Do not bother with a buffer larger than the input file, plus one
-      //        byte to make sure the file has not grown while reading it.  */
-      //     if (S_ISREG (src_open_sb.st_mode) && src_open_sb.st_size < buf_size)
-      //       buf_size = src_open_sb.st_size + 1;
+          if (ok) goto preserve_metadata;
+          if (! normal_copy_required)
+            {
+              return_val = false;
+              goto close_src_and_dst_desc;
+            }
+          else
+            *io_error = false;
+        }
 
-      //     /* However, stick with a block size that is a positive multiple of
-      //        blcm, overriding the above adjustments.  Watch out for
-      //        overflow.  */
-      //     buf_size += blcm - 1;
-      //     buf_size -= buf_size % blcm;
-      //     if (buf_size == 0 || blcm_max < buf_size)
-      //       buf_size = blcm;
-      //   }
+      if (x->copy_range_threads && ! make_holes && ! sparse_src
+          && ! unwritten_src
+          && S_ISREG (sb.st_mode) && AIO_SPLIT_SIZE < src_open_sb.st_size)
+        {
+          bool normal_copy_required;
 
-      // buf_alloc = xmalloc (buf_size + buf_alignment);
-      // buf = ptr_align (buf_alloc, buf_alignment);
+          /* Let the kernel copy the data, falling back to the ring if
+             it cannot between these files.  */
+          ok = range_copy (source_desc, dest_desc, src_open_sb.st_size,
+                           x->copy_range_threads, src_name, dst_name,
+                           &normal_copy_required);
+          if (ok) goto preserve_metadata;
+          if (! normal_copy_required)
+            {
+              return_val = false;
+              goto close_src_and_dst_desc;
+            }
+        }
 
-      if (sparse_src)
+      if (sparse_src || unwritten_src)
         {
           bool normal_copy_required;
 
           /* Perform an efficient extent-based copy, falling back to the
              standard copy only if the initial extent scan fails.  If the
              '--sparse=never' option is specified, write all data but use
-             any extents to read more efficiently.  */
+             any extents to read more efficiently.  Preallocated space is
+             preallocated in the copy, unless with '--sparse=always'.  */
           aio_start = true;
-          ok = extent_copy (source_desc, dest_desc, hole_size, src_open_sb.st_size,
+          ok = extent_copy (source_desc, dest_desc, buf_size, hole_size,
+                            src_open_sb.st_size,
                             make_holes ? x->sparse_mode : SPARSE_NEVER,
+                            x->extent_batch,
+                            unwritten_src ? EXTENT_SCAN_FIEMAP : EXTENT_SCAN_AUTO,
                             src_name_clone, dst_name_clone, &normal_copy_required,
                             cnt, all_read_submit, io_error);
           if (*cnt == 0) aio_start = false;
@@ -1619,7 +4989,8 @@ copy_reg (char const *src_name, char const *dst_name,
       off_t n_read;
       bool wrote_hole_at_eof;
       aio_start = true;
-      ok = sparse_copy (source_desc, dest_desc, make_holes ? hole_size : 0,
+      ok = sparse_copy (source_desc, dest_desc, buf_size,
+                        make_holes ? hole_size : 0,
                         x->sparse_mode == SPARSE_ALWAYS, src_name_clone,
                         dst_name_clone, src_open_sb.st_size, &n_read,
                         0, cnt, all_read_submit, io_error,
@@ -1727,7 +5098,11 @@ preserve_metadata:
     }
 
 close_src_and_dst_desc:
-  if (!aio_start)
+  /* Requests in flight reach fixed files through the ring, so
+     their descriptors can be closed right away.  */
+  if (fixed_files)
+    aio_file_release_pair (source_desc, dest_desc, aio_start);
+  if (!aio_start || fixed_files)
     {
       if (close (dest_desc) < 0)
         {
@@ -1736,13 +5111,17 @@ close_src_and_dst_desc:
         }
     }
 close_src_desc:
-  if (!aio_start)
+  if (!aio_start || fixed_files)
     {
       if (close (source_desc) < 0)
         {
           error (0, errno, _("failed to close %s"), quoteaf (src_name));
           return_val = false;
         }
+      aio_fd_release (2);
+    }
+  if (!aio_start)
+    {
       free(cnt);
       free(all_read_submit);
       free(io_error);
@@ -1755,6 +5134,48 @@ close_src_desc:
   return return_val;
 }
 
+/* Return true if copying the regular file SRC_SB to a new destination
+   can be left to aio_file_start: a plain copy of a new, non-sparse file,
+   with no attributes to preserve that would need the open files.
+   Files copy_internal records for preserving hard links are not: a
+   later link to one would be made before the ring creates it.
+   Command-line arguments are recorded in x->dest_info right after the
+   copy, so they keep going through copy_reg.  So do preallocated files,
+   which copy_reg copies extent by extent: SRC_NAME is opened to look
+   for unwritten extents if it is large enough to have them checked,
+   with a descriptor taken out of the budget.  */
+static bool
+aio_file_eligible (struct cp_options const *x, char const *src_name,
+                   struct stat const *src_sb,
+                   bool new_dst, bool command_line_arg,
+                   mode_t omitted_permissions)
+{
+  if (! (new_dst && ! command_line_arg && S_ISREG (src_sb->st_mode)
+         && x->data_copy_required && x->reflink_mode == REFLINK_NEVER
+         && x->sparse_mode != SPARSE_ALWAYS && ! is_probably_sparse (src_sb)
+         && ! (x->copy_range_threads && AIO_SPLIT_SIZE < src_sb->st_size)
+         && ! (x->preserve_links
+               && (1 < src_sb->st_nlink || x->dereference == DEREF_ALWAYS))
+         && ! pio_engine
+         && ! omitted_permissions && ! x->move_mode && ! x->set_mode
+         && ! x->preserve_mode && ! x->explicit_no_preserve_mode
+         && ! x->preserve_ownership && ! x->preserve_timestamps
+         && ! x->preserve_xattr && ! x->set_security_context
+         && ! x->preserve_security_context))
+    return false;
+
+  if (src_sb->st_size < UNWRITTEN_MIN_SIZE)
+    return true;
+  while (! aio_fd_take (1))
+    aio_fd_wait (1);
+  int fd = open (src_name, O_RDONLY | O_BINARY | O_NOCTTY | O_CLOEXEC);
+  bool unwritten = fd < 0 || has_unwritten_extents (fd, src_sb);
+  if (0 <= fd)
+    close (fd);
+  aio_fd_release (1);
+  return ! unwritten;
+}
+
 /* Return true if it's ok that the source and destination
    files are the 'same' by some measure.  The goal is to avoid
    making the 'copy' operation remove both copies of the file
@@ -2941,6 +6362,11 @@ copy_internal (char const *src_name, char const *dst_name,
           delayed_ok = copy_dir (src_name, dst_name, new_dst, &src_sb, dir, x,
                                  first_dir_created_per_command_line_arg,
                                  copy_into_self);
+
+          /* Files queued by aio_file_start must be created before the
+             directory loses the owner permissions it was created with.  */
+          if ((src_mode & S_IRWXU) != S_IRWXU)
+            aio_file_settle ();
         }
     }
   else if (x->symbolic_link)
@@ -3019,8 +6445,13 @@ copy_internal (char const *src_name, char const *dst_name,
          normally the same, and the exception (where x->set_mode) is
          used only by 'install', which POSIX does not specify and
          where DST_MODE_BITS is what's wanted.  */
-      if (! copy_reg (src_name, dst_name, x, dst_mode_bits & S_IRWXUGO,
-                      omitted_permissions, &new_dst, &src_sb))
+      bool queued = (aio_file_eligible (x, src_name, &src_sb, new_dst,
+                                        command_line_arg, omitted_permissions)
+                     && aio_file_start (src_name, dst_name, x,
+                                        dst_mode_bits & S_IRWXUGO, &src_sb));
+      if (! queued
+          && ! copy_reg (src_name, dst_name, x, dst_mode_bits & S_IRWXUGO,
+                         omitted_permissions, &new_dst, &src_sb))
         goto un_backup;
     }
   else if (S_ISFIFO (src_mode))
@@ -3293,6 +6724,9 @@ valid_options (const struct cp_options *co)
   assert (VALID_BACKUP_TYPE (co->backup_type));
   assert (VALID_SPARSE_MODE (co->sparse_mode));
   assert (VALID_REFLINK_MODE (co->reflink_mode));
+  assert (VALID_URING_BUFFERS (co->uring_buffers));
+  assert (VALID_URING_SCHED (co->uring_sched));
+  assert (VALID_COPY_ORDER (co->order));
   assert (!(co->hard_link && co->symbolic_link));
   assert (!
           (co->reflink_mode == REFLINK_ALWAYS
@@ -3315,27 +6749,33 @@ copy (char const *src_name, char const *dst_name,
       bool *copy_into_self, bool *rename_succeeded)
 {
   assert (valid_options (options));
-
-  // initialize AIO buffer queue
-  int ret = io_uring_queue_init(QD, &aio_ring, 0);
-  if (ret < 0)
-  {
-    fprintf(stderr, "error initializing io_uring: %s\n", strerror(-ret));
-    return false;
-  }
-
-  // initialize AIO buffer queue
-  ret = aio_buf_queue_init();
-  if (ret < 0) return false;
-
-  // register AIO buffer
-  ret = io_uring_register_buffers(&aio_ring, aio_buf, QD);
-  if (ret < 0)
+  aio_failed = false;
+
+  // statistics are per source: drop what earlier calls counted
+  memset(&aio_stats, 0, sizeof aio_stats);
+  pthread_mutex_lock(&aio_pool_lock);
+  memset(&aio_stats_total, 0, sizeof aio_stats_total);
+  pthread_mutex_unlock(&aio_pool_lock);
+  pthread_mutex_lock(&pio_lock);
+  pio_reads = pio_writes = 0;
+  pthread_mutex_unlock(&pio_lock);
+
+  // read directories ahead of the copy
+  if (options->recursive)
+    walk_init (options->walkers, options->one_file_system);
+
+  // start with an engine of our own, sharing the buffer budget with the
+  // worker engines, if any
+  int share = options->threads > 1 ? options->threads + 1 : 1;
+  if (!aio_engine_init(options, share))
   {
-    fprintf(stderr, "Fail to register buffer: %s\n", strerror(-ret));
-    aio_exit(false);
+    walk_exit ();
     return false;
   }
+  if (aio_fd_budget == 0)
+    aio_fd_init(options);
+  if (options->threads > 1 && aio_nworkers == 0 && !pio_engine)
+    aio_pool_start(options);
 
   /* Record the file names: they're used in case of error, when copying
      a directory into itself.  I don't like to make these tools do *any*
@@ -3354,8 +6794,20 @@ copy (char const *src_name, char const *dst_name,
                           copy_into_self, rename_succeeded);
 
   aio_wait_all_comp();
+  if (aio_nworkers)
+  {
+    aio_pool_quiesce();
+    aio_pool_stop();
+  }
+  aio_stats_engine();
+  aio_stats_merge();
+  pthread_mutex_lock(&aio_pool_lock);
+  aio_stats = aio_stats_total;
+  pthread_mutex_unlock(&aio_pool_lock);
+  if (aio_print_stats) aio_stats_print();
+  walk_exit ();
   aio_exit(false);
-  return ok;
+  return ok && !aio_failed;
 }
 
 /* Set *X to the default options for a value of type struct cp_options.  */
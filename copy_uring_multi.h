@@ -56,6 +56,49 @@ enum Reflink_type
   REFLINK_ALWAYS
 };
 
+/* Control where the io_uring engine takes I/O buffers from.  */
+enum Uring_buffers
+{
+  /* Registered buffers handed out from a user-space queue.  */
+  URING_BUFFERS_QUEUE,
+
+  /* Registered buffers in a provided buffer ring: the kernel picks
+     the buffer of each read.  */
+  URING_BUFFERS_RING,
+
+  /* Registered buffers carved into size-class slabs, so that small
+     chunks take small objects.  */
+  URING_BUFFERS_SLAB
+};
+
+/* Control the order in which the io_uring engine prepares the chunks
+   of the files it copies end to end.  */
+enum Uring_sched
+{
+  /* All chunks of a file before those of the next one.  */
+  URING_SCHED_FIFO,
+
+  /* One chunk of each file in turn.  */
+  URING_SCHED_RR,
+
+  /* Chunks of the file with the fewest bytes left to prepare first.  */
+  URING_SCHED_SRF
+};
+
+/* Control the order in which the entries of a directory are copied.  */
+enum Copy_order
+{
+  /* The order savedir returns them in.  */
+  COPY_ORDER_DIRECTORY,
+
+  /* Regular files, largest first, then the other entries.  */
+  COPY_ORDER_SIZE,
+
+  /* Regular files by the physical address of their first extent on the
+     source device, then the other entries.  */
+  COPY_ORDER_PHYSICAL
+};
+
 /* This type is used to help mv (via copy.c) distinguish these cases.  */
 enum Interactive
 {
@@ -81,6 +124,10 @@ enum Dereference_symlink
   DEREF_ALWAYS
 };
 
+/* Size of each I/O buffer of the io_uring engine, and the most one
+   request transfers.  */
+# define URING_BUFFER_SIZE (10 * 1024 * 1024)
+
 # define VALID_SPARSE_MODE(Mode)	\
   ((Mode) == SPARSE_NEVER		\
    || (Mode) == SPARSE_AUTO		\
@@ -91,6 +138,21 @@ enum Dereference_symlink
    || (Mode) == REFLINK_AUTO		\
    || (Mode) == REFLINK_ALWAYS)
 
+# define VALID_URING_BUFFERS(Mode)	\
+  ((Mode) == URING_BUFFERS_QUEUE		\
+   || (Mode) == URING_BUFFERS_RING		\
+   || (Mode) == URING_BUFFERS_SLAB)
+
+# define VALID_URING_SCHED(Mode)	\
+  ((Mode) == URING_SCHED_FIFO		\
+   || (Mode) == URING_SCHED_RR		\
+   || (Mode) == URING_SCHED_SRF)
+
+# define VALID_COPY_ORDER(Mode)	\
+  ((Mode) == COPY_ORDER_DIRECTORY		\
+   || (Mode) == COPY_ORDER_SIZE		\
+   || (Mode) == COPY_ORDER_PHYSICAL)
+
 /* These options control how files are copied by at least the
    following programs: mv (when rename doesn't work), cp, install.
    So, if you add a new member, be sure to initialize it in
@@ -261,6 +323,55 @@ struct cp_options
   /* Control creation of COW files.  */
   enum Reflink_type reflink_mode;
 
+  /* If true, submit the read and the write of each chunk to io_uring
+     as one linked chain, so the kernel starts the write as soon as the
+     read completes, without a round trip through user space.  */
+  bool uring_link;
+
+  /* If true, print io_uring engine statistics to stderr.  */
+  bool uring_stats;
+
+  /* Control where the io_uring engine takes I/O buffers from.  */
+  enum Uring_buffers uring_buffers;
+
+  /* Control the order in which chunks of files in flight are prepared.  */
+  enum Uring_sched uring_sched;
+
+  /* Upper bound, in bytes, on the memory the io_uring engine allocates
+     for I/O buffers.  Buffers are allocated as they are needed, up to
+     this bound, which must leave each engine at least one buffer of
+     URING_BUFFER_SIZE bytes.  Zero means a default limited by
+     RLIMIT_MEMLOCK.  */
+  uintmax_t buffer_memory;
+
+  /* If true, let a kernel thread poll the io_uring submission queue.
+     It goes to sleep after URING_SQPOLL_IDLE milliseconds without work,
+     and runs on CPU URING_SQ_CPU unless that is negative.  */
+  bool uring_sqpoll;
+  unsigned int uring_sqpoll_idle;
+  int uring_sq_cpu;
+
+  /* Number of threads reading directories ahead of a recursive copy.
+     Zero means directories are read by the copy as it reaches them.  */
+  size_t walkers;
+
+  /* Number of threads copying each regular file of more than 64 MiB
+     with copy_file_range, instead of through the ring.  Zero means such
+     files go through the ring like the others.  */
+  size_t copy_range_threads;
+
+  /* The most extents looked up at a time in a sparse file.  Copying
+     starts after a smaller first batch; the next batches are looked up
+     while the previous ones are in flight.  */
+  size_t extent_batch;
+
+  /* Control the order in which the entries of a directory are copied.  */
+  enum Copy_order order;
+
+  /* Number of threads copying files, each with an io_uring engine of
+     its own.  With one, files are copied on the calling thread.  */
+  size_t threads;
+
   /* This is a set of destination name/inode/dev triples.  Each such triple
      represents a file we have created corresponding to a source file name
      that was specified on the command line.  Use it to avoid clobbering
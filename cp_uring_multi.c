@@ -29,11 +29,13 @@
 #include "cp-hash.h"
 #include "die.h"
 #include "error.h"
+#include "extent-scan.h"
 #include "filenamecat.h"
 #include "ignore-value.h"
 #include "quote.h"
 #include "stat-time.h"
 #include "utimens.h"
+#include "xstrtol.h"
 #include "acl.h"
 
 #if ! HAVE_LCHOWN
@@ -64,14 +66,26 @@ struct dir_attr
 enum
 {
   ATTRIBUTES_ONLY_OPTION = CHAR_MAX + 1,
+  BUFFER_MEMORY_OPTION,
   COPY_CONTENTS_OPTION,
+  COPY_FILE_RANGE_OPTION,
+  EXTENT_BATCH_OPTION,
   NO_PRESERVE_ATTRIBUTES_OPTION,
+  ORDER_OPTION,
   PARENTS_OPTION,
   PRESERVE_ATTRIBUTES_OPTION,
   REFLINK_OPTION,
   SPARSE_OPTION,
   STRIP_TRAILING_SLASHES_OPTION,
-  UNLINK_DEST_BEFORE_OPENING
+  THREADS_OPTION,
+  UNLINK_DEST_BEFORE_OPENING,
+  WALKERS_OPTION,
+  URING_BUFFERS_OPTION,
+  URING_LINK_OPTION,
+  URING_SCHED_OPTION,
+  URING_SQ_CPU_OPTION,
+  URING_SQPOLL_OPTION,
+  URING_STATS_OPTION
 };
 
 /* True if the kernel is SELinux enabled.  */
@@ -104,13 +118,46 @@ static enum Reflink_type const reflink_type[] =
 };
 ARGMATCH_VERIFY (reflink_type_string, reflink_type);
 
+static char const *const uring_buffers_string[] =
+{
+  "queue", "ring", "slab", NULL
+};
+static enum Uring_buffers const uring_buffers[] =
+{
+  URING_BUFFERS_QUEUE, URING_BUFFERS_RING, URING_BUFFERS_SLAB
+};
+ARGMATCH_VERIFY (uring_buffers_string, uring_buffers);
+
+static char const *const uring_sched_string[] =
+{
+  "fifo", "rr", "srf", NULL
+};
+static enum Uring_sched const uring_sched[] =
+{
+  URING_SCHED_FIFO, URING_SCHED_RR, URING_SCHED_SRF
+};
+ARGMATCH_VERIFY (uring_sched_string, uring_sched);
+
+static char const *const copy_order_string[] =
+{
+  "directory", "size", "physical", NULL
+};
+static enum Copy_order const copy_order[] =
+{
+  COPY_ORDER_DIRECTORY, COPY_ORDER_SIZE, COPY_ORDER_PHYSICAL
+};
+ARGMATCH_VERIFY (copy_order_string, copy_order);
+
 static struct option const long_opts[] =
 {
   {"archive", no_argument, NULL, 'a'},
   {"attributes-only", no_argument, NULL, ATTRIBUTES_ONLY_OPTION},
   {"backup", optional_argument, NULL, 'b'},
+  {"buffer-memory", required_argument, NULL, BUFFER_MEMORY_OPTION},
   {"copy-contents", no_argument, NULL, COPY_CONTENTS_OPTION},
+  {"copy-file-range", optional_argument, NULL, COPY_FILE_RANGE_OPTION},
   {"dereference", no_argument, NULL, 'L'},
+  {"extent-batch", required_argument, NULL, EXTENT_BATCH_OPTION},
   {"force", no_argument, NULL, 'f'},
   {"interactive", no_argument, NULL, 'i'},
   {"link", no_argument, NULL, 'l'},
@@ -119,6 +166,7 @@ static struct option const long_opts[] =
   {"no-preserve", required_argument, NULL, NO_PRESERVE_ATTRIBUTES_OPTION},
   {"no-target-directory", no_argument, NULL, 'T'},
   {"one-file-system", no_argument, NULL, 'x'},
+  {"order", required_argument, NULL, ORDER_OPTION},
   {"parents", no_argument, NULL, PARENTS_OPTION},
   {"path", no_argument, NULL, PARENTS_OPTION},   /* Deprecated.  */
   {"preserve", optional_argument, NULL, PRESERVE_ATTRIBUTES_OPTION},
@@ -130,8 +178,16 @@ static struct option const long_opts[] =
   {"suffix", required_argument, NULL, 'S'},
   {"symbolic-link", no_argument, NULL, 's'},
   {"target-directory", required_argument, NULL, 't'},
+  {"threads", required_argument, NULL, THREADS_OPTION},
   {"update", no_argument, NULL, 'u'},
+  {"uring-buffers", required_argument, NULL, URING_BUFFERS_OPTION},
+  {"uring-link", no_argument, NULL, URING_LINK_OPTION},
+  {"uring-sched", required_argument, NULL, URING_SCHED_OPTION},
+  {"uring-sq-cpu", required_argument, NULL, URING_SQ_CPU_OPTION},
+  {"uring-sqpoll", optional_argument, NULL, URING_SQPOLL_OPTION},
+  {"uring-stats", no_argument, NULL, URING_STATS_OPTION},
   {"verbose", no_argument, NULL, 'v'},
+  {"walkers", required_argument, NULL, WALKERS_OPTION},
   {GETOPT_SELINUX_CONTEXT_OPTION_DECL},
   {GETOPT_HELP_OPTION_DECL},
   {GETOPT_VERSION_OPTION_DECL},
@@ -225,6 +281,40 @@ Copy SOURCE to DEST, or multiple SOURCE(s) to DIRECTORY.\n\
                                  file to default type\n\
       --context[=CTX]          like -Z, or if CTX is specified then set the\n\
                                  SELinux or SMACK security context to CTX\n\
+"), stdout);
+      fputs (_("\
+\n\
+io_uring engine options:\n\
+      --buffer-memory=SIZE     allocate at most SIZE bytes of I/O buffers;\n\
+                                 buffers are allocated as they are needed;\n\
+                                 at least 10 MiB per engine (see --threads)\n\
+      --copy-file-range[=N]    copy regular files of more than 64 MiB with\n\
+                                 copy_file_range on N threads (default 4)\n\
+                                 instead of through the ring, if the file\n\
+                                 systems allow\n\
+      --extent-batch=N         look up at most N extents of a sparse file at\n\
+                                 a time (default 1024)\n\
+      --order=ORDER            copy the entries of each directory in ORDER:\n\
+                                 'directory' (default), 'size' (regular\n\
+                                 files largest first) or 'physical'\n\
+                                 (by first block on the source device)\n\
+      --threads=N              copy files on N threads, each with its own\n\
+                                 ring and share of the buffers (default 1)\n\
+      --uring-buffers=WHERE    take I/O buffers from size-class slabs, a\n\
+                                 user-space queue or a provided buffer ring\n\
+                                 (see below)\n\
+      --uring-link             submit the read and write of each chunk as one\n\
+                                 linked chain\n\
+      --uring-sched=POLICY     order the chunks of files in flight: fifo,\n\
+                                 rr or srf (see below)\n\
+      --uring-sq-cpu=CPU       run the --uring-sqpoll thread on CPU; only\n\
+                                 valid with --uring-sqpoll\n\
+      --uring-sqpoll[=MS]      let a kernel thread poll for submissions; it\n\
+                                 sleeps after MS idle milliseconds (default\n\
+                                 1000)\n\
+      --uring-stats            print io_uring statistics to standard error\n\
+      --walkers=N              read directories ahead of a recursive copy\n\
+                                 with N threads (default 4, 0 to disable)\n\
 "), stdout);
       fputs (HELP_OPTION_DESCRIPTION, stdout);
       fputs (VERSION_OPTION_DESCRIPTION, stdout);
@@ -242,6 +332,25 @@ When --reflink[=always] is specified, perform a lightweight copy, where the\n\
 data blocks are copied only when modified.  If this is not possible the copy\n\
 fails, or if --reflink=auto is specified, fall back to a standard copy.\n\
 Use --reflink=never to ensure a standard copy is performed.\n\
+"), stdout);
+      fputs (_("\
+\n\
+By default the io_uring engine carves its registered I/O buffers into slabs\n\
+of size classes, so that each chunk only takes as much buffer space as it\n\
+needs (--uring-buffers=slab).  With --uring-buffers=queue every chunk takes\n\
+a whole buffer.  With --uring-buffers=ring whole buffers are provided to the\n\
+kernel, which picks one for each read when it runs; --uring-link is ignored\n\
+in that mode.  Buffers are allocated on demand; once --buffer-memory is\n\
+used up, new chunks wait for in-flight ones to release their buffers.\n\
+"), stdout);
+      fputs (_("\
+\n\
+Files copied through the ring share it chunk by chunk.  --uring-sched=rr\n\
+(the default) prepares one chunk of each file in turn, --uring-sched=srf\n\
+favors the file with the fewest bytes left, so small files are not held up\n\
+by large ones, and --uring-sched=fifo copies files one after the other.\n\
+On rotational disks, combine --order=physical with --uring-sched=fifo so\n\
+that files are read in the order of their blocks.\n\
 "), stdout);
       emit_backup_suffix_note ();
       fputs (_("\
@@ -827,6 +936,20 @@ cp_option_init (struct cp_options *x)
      But POSIX requires it.  */
   x->open_dangling_dest_symlink = getenv ("POSIXLY_CORRECT") != NULL;
 
+  x->uring_link = false;
+  x->uring_stats = false;
+  x->uring_buffers = URING_BUFFERS_SLAB;
+  x->uring_sched = URING_SCHED_RR;
+  x->buffer_memory = 0;
+  x->uring_sqpoll = false;
+  x->uring_sqpoll_idle = 1000;
+  x->uring_sq_cpu = -1;
+  x->walkers = 4;
+  x->order = COPY_ORDER_DIRECTORY;
+  x->threads = 1;
+  x->extent_batch = EXTENT_SCAN_BATCH;
+  x->copy_range_threads = 0;
+
   x->dest_info = NULL;
   x->src_info = NULL;
 }
@@ -956,6 +1079,11 @@ main (int argc, char **argv)
     {
       switch (c)
         {
+        case ORDER_OPTION:
+          x.order = XARGMATCH ("--order", optarg,
+                               copy_order_string, copy_order);
+          break;
+
         case SPARSE_OPTION:
           x.sparse_mode = XARGMATCH ("--sparse", optarg,
                                      sparse_type_string, sparse_type);
@@ -1068,6 +1196,105 @@ main (int argc, char **argv)
           x.unlink_dest_before_opening = true;
           break;
 
+        case BUFFER_MEMORY_OPTION:
+          {
+            uintmax_t n;
+            if (xstrtoumax (optarg, NULL, 10, &n, "bkKmMGTPEZY0") != LONGINT_OK
+                || n == 0)
+              die (EXIT_FAILURE, 0, _("invalid buffer memory size: %s"),
+                   quote (optarg));
+            x.buffer_memory = n;
+          }
+          break;
+
+        case COPY_FILE_RANGE_OPTION:
+          x.copy_range_threads = 4;
+          if (optarg)
+            {
+              uintmax_t n;
+              if (xstrtoumax (optarg, NULL, 10, &n, "") != LONGINT_OK
+                  || n == 0 || 256 < n)
+                die (EXIT_FAILURE, 0, _("invalid number of threads: %s"),
+                     quote (optarg));
+              x.copy_range_threads = n;
+            }
+          break;
+
+        case EXTENT_BATCH_OPTION:
+          {
+            uintmax_t n;
+            if (xstrtoumax (optarg, NULL, 10, &n, "") != LONGINT_OK
+                || n < 2 || 1024 * 1024 < n)
+              die (EXIT_FAILURE, 0, _("invalid extent batch size: %s"),
+                   quote (optarg));
+            x.extent_batch = n;
+          }
+          break;
+
+        case URING_SCHED_OPTION:
+          x.uring_sched = XARGMATCH ("--uring-sched", optarg,
+                                     uring_sched_string, uring_sched);
+          break;
+
+        case URING_BUFFERS_OPTION:
+          x.uring_buffers = XARGMATCH ("--uring-buffers", optarg,
+                                       uring_buffers_string, uring_buffers);
+          break;
+
+        case URING_LINK_OPTION:
+          x.uring_link = true;
+          break;
+
+        case URING_SQ_CPU_OPTION:
+          {
+            uintmax_t n;
+            if (xstrtoumax (optarg, NULL, 10, &n, "") != LONGINT_OK
+                || INT_MAX < n)
+              die (EXIT_FAILURE, 0, _("invalid CPU number: %s"),
+                   quote (optarg));
+            x.uring_sq_cpu = n;
+          }
+          break;
+
+        case URING_SQPOLL_OPTION:
+          x.uring_sqpoll = true;
+          if (optarg)
+            {
+              uintmax_t n;
+              if (xstrtoumax (optarg, NULL, 10, &n, "") != LONGINT_OK
+                  || UINT_MAX < n)
+                die (EXIT_FAILURE, 0, _("invalid idle time: %s"),
+                     quote (optarg));
+              x.uring_sqpoll_idle = n;
+            }
+          break;
+
+        case URING_STATS_OPTION:
+          x.uring_stats = true;
+          break;
+
+        case THREADS_OPTION:
+          {
+            uintmax_t n;
+            if (xstrtoumax (optarg, NULL, 10, &n, "") != LONGINT_OK
+                || n == 0 || 256 < n)
+              die (EXIT_FAILURE, 0, _("invalid number of threads: %s"),
+                   quote (optarg));
+            x.threads = n;
+          }
+          break;
+
+        case WALKERS_OPTION:
+          {
+            uintmax_t n;
+            if (xstrtoumax (optarg, NULL, 10, &n, "") != LONGINT_OK
+                || 256 < n)
+              die (EXIT_FAILURE, 0, _("invalid number of walkers: %s"),
+                   quote (optarg));
+            x.walkers = n;
+          }
+          break;
+
         case STRIP_TRAILING_SLASHES_OPTION:
           remove_trailing_slashes = true;
           break;
@@ -1156,6 +1383,22 @@ main (int argc, char **argv)
       usage (EXIT_FAILURE);
     }
 
+  /* Each engine needs a buffer.  */
+  if (x.buffer_memory
+      && x.buffer_memory / (x.threads > 1 ? x.threads + 1 : 1)
+         < URING_BUFFER_SIZE)
+    {
+      error (0, 0, _("--buffer-memory must allow %d MiB for each engine"),
+             URING_BUFFER_SIZE / (1024 * 1024));
+      usage (EXIT_FAILURE);
+    }
+
+  if (0 <= x.uring_sq_cpu && ! x.uring_sqpoll)
+    {
+      error (0, 0, _("--uring-sq-cpu can be used only with --uring-sqpoll"));
+      usage (EXIT_FAILURE);
+    }
+
   if (x.reflink_mode == REFLINK_ALWAYS && x.sparse_mode != SPARSE_AUTO)
     {
       error (0, 0, _("--reflink can be used only with --sparse=auto"));
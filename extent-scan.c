@@ -75,6 +75,21 @@ extent_scan_init (int src_fd, struct extent_scan *scan)
   scan->initial_scan_failed = false;
   scan->hit_final_extent = false;
   scan->fm_flags = extent_need_sync () ? FIEMAP_FLAG_SYNC : 0;
+  scan->method = EXTENT_SCAN_AUTO;
+  scan->batch = EXTENT_SCAN_BATCH;
+  scan->ei_batch = EXTENT_SCAN_FIRST_BATCH;
+}
+
+/* Return how many extents the next read asks for.  Reads start small,
+   so that the copy can start on the first extents early, and double up
+   to SCAN->batch, which bounds the memory of each read.  */
+static size_t
+extent_scan_count (struct extent_scan *scan)
+{
+  size_t batch = MAX (2, scan->batch);
+  size_t count = MIN (scan->ei_batch, batch);
+  scan->ei_batch = count <= batch / 2 ? 2 * count : batch;
+  return count;
 }
 
 #ifdef __linux__
@@ -83,25 +98,22 @@ extent_scan_init (int src_fd, struct extent_scan *scan)
 # endif
 /* Call ioctl(2) with FS_IOC_FIEMAP (available in linux 2.6.27) to
    obtain a map of file extents excluding holes.  */
-extern bool
-extent_scan_read (struct extent_scan *scan)
+static bool
+extent_scan_fiemap_batch (struct extent_scan *scan, struct fiemap *fiemap,
+                          size_t count)
 {
   unsigned int si = 0;
   struct extent_info *last_ei = scan->ext_info;
+  struct fiemap_extent *fm_extents = &fiemap->fm_extents[0];
+  size_t fiemap_size = offsetof (struct fiemap, fm_extents)
+                       + count * sizeof *fm_extents;
 
   while (true)
     {
-      union { struct fiemap f; char c[4096]; } fiemap_buf;
-      struct fiemap *fiemap = &fiemap_buf.f;
-      struct fiemap_extent *fm_extents = &fiemap->fm_extents[0];
-      enum { headersize = offsetof (struct fiemap, fm_extents) };
-      enum { count = (sizeof fiemap_buf - headersize) / sizeof *fm_extents };
-      verify (count > 1);
-
       /* This is required at least to initialize fiemap->fm_start,
          but also serves (in mid 2010) to appease valgrind, which
          appears not to know the semantics of the FIEMAP ioctl. */
-      memset (&fiemap_buf, 0, sizeof fiemap_buf);
+      memset (fiemap, 0, fiemap_size);
 
       fiemap->fm_start = scan->scan_start;
       fiemap->fm_flags = scan->fm_flags;
@@ -217,12 +229,151 @@ extent_scan_read (struct extent_scan *scan)
 
   return true;
 }
+
+/* Read up to one batch of extents with FIEMAP, into a buffer sized
+   for the batch.  */
+static bool
+extent_scan_fiemap (struct extent_scan *scan)
+{
+  size_t count = extent_scan_count (scan);
+  struct fiemap *fiemap
+    = xmalloc (offsetof (struct fiemap, fm_extents)
+               + count * sizeof (struct fiemap_extent));
+  bool ok = extent_scan_fiemap_batch (scan, fiemap, count);
+  int saved_errno = errno;
+  free (fiemap);
+  errno = saved_errno;
+  return ok;
+}
 #else
-extern bool
-extent_scan_read (struct extent_scan *scan _GL_UNUSED)
+static bool
+extent_scan_fiemap (struct extent_scan *scan)
 {
   scan->initial_scan_failed = true;
   errno = ENOTSUP;
   return false;
 }
 #endif
+
+#ifdef SEEK_HOLE
+/* Call lseek(2) with SEEK_DATA and SEEK_HOLE (available in linux 3.1)
+   to obtain the data regions of the file, without flags.  Unlike
+   FIEMAP this needs no sync of the file, and works on file systems
+   without FIEMAP such as tmpfs, overlayfs and NFS.  The file offset
+   is left where it was, as the callers may read from it.  */
+static bool
+extent_scan_seek (struct extent_scan *scan)
+{
+  size_t count = extent_scan_count (scan);
+  size_t si = 0;
+  off_t pos = scan->scan_start;
+  off_t orig = lseek (scan->fd, 0, SEEK_CUR);
+  if (orig < 0)
+    goto fail;
+
+  scan->ext_info = xnrealloc (scan->ext_info, count,
+                              sizeof (struct extent_info));
+  while (si < count)
+    {
+      off_t data = lseek (scan->fd, pos, SEEK_DATA);
+      if (data < 0)
+        {
+          /* No data at or after POS.  */
+          if (errno != ENXIO)
+            goto fail;
+          scan->hit_final_extent = true;
+          break;
+        }
+
+      off_t hole = lseek (scan->fd, data, SEEK_HOLE);
+      if (hole < 0)
+        goto fail;
+      /* The file shrank between the two calls.  */
+      if (hole <= data)
+        {
+          scan->hit_final_extent = true;
+          break;
+        }
+
+      scan->ext_info[si].ext_logical = data;
+      scan->ext_info[si].ext_length = hole - data;
+      scan->ext_info[si].ext_flags = 0;
+      si++;
+      pos = hole;
+    }
+
+  if (lseek (scan->fd, orig, SEEK_SET) < 0)
+    goto fail;
+
+  scan->ei_count = si;
+  if (si == 0)
+    {
+      scan->hit_final_extent = true;
+      return scan->scan_start != 0;
+    }
+  scan->scan_start = pos;
+  return true;
+
+ fail:
+  if (scan->scan_start == 0 && si == 0)
+    scan->initial_scan_failed = true;
+  extent_scan_free (scan);
+  return false;
+}
+#endif
+
+/* Return true if FIEMAP reports an unwritten extent, i.e. preallocated
+   space, in the file open on FD.  SEEK_DATA reports such extents as
+   holes, yet their blocks are allocated, so that neither it nor the
+   block count tells them apart from data.  The file is not synced
+   first, so that data not yet written back to an unwritten extent may
+   show it as unwritten still: scan again with FIEMAP_FLAG_SYNC before
+   skipping one.  */
+extern bool
+extent_scan_unwritten (int fd)
+{
+  struct extent_scan scan;
+  bool found = false;
+
+  extent_scan_init (fd, &scan);
+  scan.method = EXTENT_SCAN_FIEMAP;
+  scan.fm_flags = 0;
+  while (! found && extent_scan_read (&scan))
+    {
+      for (size_t i = 0; i < scan.ei_count; i++)
+        if (scan.ext_info[i].ext_flags & FIEMAP_EXTENT_UNWRITTEN)
+          found = true;
+      extent_scan_free (&scan);
+      if (scan.hit_final_extent)
+        break;
+    }
+  extent_scan_free (&scan);
+  return found;
+}
+
+/* Fill SCAN->ext_info with the next extents of the file, with the
+   backend in SCAN->method.  EXTENT_SCAN_AUTO uses SEEK_DATA, which
+   needs no sync, and falls back to FIEMAP where lseek does not
+   support it.  */
+extern bool
+extent_scan_read (struct extent_scan *scan)
+{
+#ifdef SEEK_HOLE
+  if (scan->method == EXTENT_SCAN_AUTO)
+    {
+      scan->method = EXTENT_SCAN_SEEK;
+      if (extent_scan_seek (scan))
+        return true;
+      if (! scan->initial_scan_failed
+          || ! (errno == EINVAL || is_ENOTSUP (errno)))
+        return false;
+      scan->initial_scan_failed = false;
+      scan->method = EXTENT_SCAN_FIEMAP;
+    }
+
+  if (scan->method == EXTENT_SCAN_SEEK)
+    return extent_scan_seek (scan);
+#endif
+
+  return extent_scan_fiemap (scan);
+}
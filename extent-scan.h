@@ -0,0 +1,104 @@
+/* core functions for efficient reading sparse files
+   Copyright (C) 2010-2020 Free Software Foundation, Inc.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+   Written by Jie Liu (jeff.liu@oracle.com).  */
+
+#ifndef EXTENT_SCAN_H
+# define EXTENT_SCAN_H
+
+/* Structure used to store information of each extent.  */
+struct extent_info
+{
+  /* Logical offset of an extent.  */
+  off_t ext_logical;
+
+  /* Extent length.  */
+  off_t ext_length;
+
+  /* Extent flags, use it for FIEMAP only, or set it to zero.  */
+  unsigned int ext_flags;
+};
+
+/* How extents are found.  */
+enum extent_scan_method
+{
+  /* SEEK_DATA/SEEK_HOLE where lseek supports them, else FIEMAP.  */
+  EXTENT_SCAN_AUTO,
+
+  /* lseek with SEEK_DATA and SEEK_HOLE; no flags are reported.  */
+  EXTENT_SCAN_SEEK,
+
+  /* ioctl with FS_IOC_FIEMAP.  */
+  EXTENT_SCAN_FIEMAP
+};
+
+/* Default for the batch member of struct extent_scan, and the number
+   of extents the first extent_scan_read asks for.  */
+# define EXTENT_SCAN_BATCH 1024
+# define EXTENT_SCAN_FIRST_BATCH 64
+
+/* Structure used to reserve extent scan information per file.  */
+struct extent_scan
+{
+  /* File descriptor of extent scan run against.  */
+  int fd;
+
+  /* Next scan start offset.  */
+  off_t scan_start;
+
+  /* Flags to use for scan.  */
+  unsigned int fm_flags;
+
+  /* The backend, settable between extent_scan_init and the first
+     extent_scan_read.  EXTENT_SCAN_AUTO is resolved by that call.  */
+  enum extent_scan_method method;
+
+  /* The most extents one extent_scan_read returns, settable like
+     method.  Reads start with fewer and double up to this many.  */
+  size_t batch;
+
+  /* How many extents the next extent_scan_read asks for.  */
+  size_t ei_batch;
+
+  /* How many extent info returned for a scan.  */
+  size_t ei_count;
+
+  /* If true, fall back to a normal copy, either set by the
+     failure of ioctl(2) for FIEMAP or lseek(2) with SEEK_DATA.  */
+  bool initial_scan_failed;
+
+  /* If true, the total extent scan per file has been finished.  */
+  bool hit_final_extent;
+
+  /* Extent information: a malloc'd array of ei_count structs.  */
+  struct extent_info *ext_info;
+};
+
+void extent_scan_init (int src_fd, struct extent_scan *scan);
+
+bool extent_scan_read (struct extent_scan *scan);
+
+bool extent_scan_unwritten (int fd);
+
+static inline void
+extent_scan_free (struct extent_scan *scan)
+{
+  free (scan->ext_info);
+  scan->ext_info = NULL;
+  scan->ei_count = 0;
+}
+
+#endif /* EXTENT_SCAN_H */
@@ -0,0 +1,26 @@
+#!/bin/bash
+# Check --buffer-memory: a budget too small for one buffer per engine
+# is refused, and copies within a budget that is just large enough
+# still come out whole.  Run from the directory holding cp_uring_multi.
+CP=${CP:-./cp_uring_multi}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+fail=0
+
+head -c 50M /dev/urandom > $dir/src
+
+for opts in "--buffer-memory=1M" "--buffer-memory=9M" "--buffer-memory=20M --threads=4"; do
+    if $CP $opts $dir/src $dir/refused 2> /dev/null || [ -e $dir/refused ]; then
+        echo "FAIL: cp $opts was accepted"; fail=1
+    fi
+done
+
+for opts in "--buffer-memory=10M" "--buffer-memory=50M --threads=4"; do
+    rm -f $dir/dst
+    if ! timeout 60 $CP $opts $dir/src $dir/dst 2> $dir/err || ! cmp -s $dir/src $dir/dst; then
+        echo "FAIL: cp $opts: $(head -1 $dir/err)"; fail=1
+    fi
+done
+
+[ $fail -eq 0 ] && echo "PASS"
+exit $fail
@@ -0,0 +1,40 @@
+#!/bin/bash
+# Check that hard links survive recursive copies that create files
+# through the ring: with -d, -a or --preserve=links, each group of links
+# in the source must be one inode in the copy, and without them, copies.
+# Run from the directory holding cp_uring_multi.
+CP=${CP:-./cp_uring_multi}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+fail=0
+
+mkdir -p $dir/src/a/b $dir/src/c
+for i in $(seq 1 200); do
+    echo "file $i" > $dir/src/a/f$i
+    ln $dir/src/a/f$i $dir/src/a/b/l$i
+    ln $dir/src/a/f$i $dir/src/c/m$i
+done
+echo single > $dir/src/c/single
+
+for opts in "-rd" "-a" "-r --preserve=links" "-rL --preserve=links"; do
+    rm -rf $dir/dst
+    if ! timeout 60 $CP $opts $dir/src $dir/dst 2> $dir/err; then
+        echo "FAIL: cp $opts: $(head -1 $dir/err)"; fail=1; continue
+    fi
+    for i in 1 100 200; do
+        if [ "$(stat -c %i $dir/dst/a/f$i)" != "$(stat -c %i $dir/dst/a/b/l$i)" ] \
+           || [ "$(stat -c %h $dir/dst/c/m$i)" != 3 ]; then
+            echo "FAIL: cp $opts did not keep the links of f$i"; fail=1; break
+        fi
+    done
+    diff -r $dir/src $dir/dst > /dev/null || { echo "FAIL: cp $opts differs"; fail=1; }
+done
+
+rm -rf $dir/dst
+timeout 60 $CP -r $dir/src $dir/dst
+if [ "$(stat -c %h $dir/dst/a/f1)" != 1 ]; then
+    echo "FAIL: cp -r linked files"; fail=1
+fi
+
+[ $fail -eq 0 ] && echo "PASS"
+exit $fail
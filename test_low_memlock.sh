@@ -0,0 +1,32 @@
+#!/bin/bash
+# Check that copies still work when RLIMIT_MEMLOCK is too small to pin
+# even one AIO buffer, as with the 8 MiB default for unprivileged users:
+# the buffers must be used unregistered rather than the copy failing.
+# Run from the directory holding cp_uring_multi.
+CP=${CP:-./cp_uring_multi}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+fail=0
+
+head -c 100M /dev/urandom > $dir/big
+mkdir $dir/tree
+for i in $(seq 1 50); do head -c $((i * 40000)) /dev/urandom > $dir/tree/f$i; done
+
+for limit in 8192 64; do
+    for opts in "" "--uring-link" "--uring-buffers=ring" "--uring-buffers=slab"; do
+        rm -rf $dir/big.copy $dir/tree.copy
+        if ! (ulimit -l $limit && timeout 60 $CP $opts $dir/big $dir/big.copy) 2> $dir/err \
+           || ! cmp -s $dir/big $dir/big.copy; then
+            echo "FAIL: memlock $limit KiB, cp $opts: $(grep -v warning $dir/err | head -1)"
+            fail=1
+        fi
+        if ! (ulimit -l $limit && timeout 60 $CP $opts --threads=4 -r $dir/tree $dir/tree.copy) \
+             2> $dir/err || ! diff -r $dir/tree $dir/tree.copy > /dev/null; then
+            echo "FAIL: memlock $limit KiB, cp $opts -r: $(grep -v warning $dir/err | head -1)"
+            fail=1
+        fi
+    done
+done
+
+[ $fail -eq 0 ] && echo "PASS"
+exit $fail
@@ -0,0 +1,51 @@
+#!/bin/bash
+# Check the pread/pwrite thread pool that copies when io_uring cannot be
+# set up, by disabling io_uring with the kernel.io_uring_disabled sysctl
+# (Linux 6.6 or later, as root) for the duration of the test: copies
+# must match, one cp may copy several sources (the pool is started and
+# joined for each), and an error in a pool thread must fail the copy.
+# Run from the directory holding cp_uring_multi.
+CP=${CP:-./cp_uring_multi}
+knob=/proc/sys/kernel/io_uring_disabled
+if ! old=$(cat $knob 2> /dev/null) || ! echo 2 > $knob 2> /dev/null; then
+    echo "SKIP: cannot disable io_uring through $knob"; exit 0
+fi
+dir=$(mktemp -d)
+trap 'echo $old > $knob; mountpoint -q $dir/full && umount $dir/full; rm -rf "$dir"' EXIT
+fail=0
+
+head -c 200M /dev/urandom > $dir/big
+head -c 64M /dev/zero > $dir/holes
+printf data | dd of=$dir/holes bs=1 seek=12345678 conv=notrunc status=none
+mkdir $dir/tree
+for i in $(seq 1 100); do head -c $((i * 5000)) /dev/urandom > $dir/tree/f$i; done
+
+timeout 60 $CP --uring-stats $dir/big $dir/big.copy 2> $dir/err
+grep -q 'unavailable' $dir/err || { echo "FAIL: the thread pool was not used"; fail=1; }
+cmp -s $dir/big $dir/big.copy || { echo "FAIL: large file differs"; fail=1; }
+
+timeout 60 $CP --sparse=always $dir/holes $dir/holes.copy
+if ! cmp -s $dir/holes $dir/holes.copy \
+   || [ $(( $(stat -c %b $dir/holes.copy) * $(stat -c %B $dir/holes.copy) )) -gt $(( 8 * 1024 * 1024 )) ]; then
+    echo "FAIL: sparse copy"; fail=1
+fi
+
+mkdir $dir/dst
+if ! timeout 60 $CP -r --threads=8 $dir/tree $dir/big $dir/holes $dir/dst \
+   || ! diff -r $dir/tree $dir/dst/tree > /dev/null || ! cmp -s $dir/big $dir/dst/big; then
+    echo "FAIL: several sources"; fail=1
+fi
+
+mkdir $dir/full
+if mount -t tmpfs -o size=16M tmpfs $dir/full 2> /dev/null; then
+    timeout 60 $CP $dir/big $dir/full/big 2> $dir/err
+    rc=$?
+    if [ $rc -eq 0 ] || ! grep -q 'No space left' $dir/err; then
+        echo "FAIL: write error not reported (exit $rc)"; fail=1
+    fi
+else
+    echo "SKIP: write errors (cannot mount a tmpfs)"
+fi
+
+[ $fail -eq 0 ] && echo "PASS"
+exit $fail
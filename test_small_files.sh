@@ -0,0 +1,41 @@
+#!/bin/bash
+# Check trees of small files, which are copied by one linked chain each:
+# with SQ polling (where submitting does not free SQ slots at once) and
+# with every buffer mode, all files must come out whole.  Also append to
+# sources while they are copied: no copy may end up shorter than the
+# source was when cp started.  Run from the directory holding
+# cp_uring_multi.
+CP=${CP:-./cp_uring_multi}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+fail=0
+
+for d in $(seq 1 20); do
+    mkdir -p $dir/src/d$d
+    for i in $(seq 1 200); do
+        head -c $(( (d * 200 + i) % 9000 )) /dev/urandom > $dir/src/d$d/f$i
+    done
+done
+
+for opts in "" "--uring-sqpoll" "--uring-sqpoll --threads=4" \
+            "--uring-buffers=slab" "--uring-buffers=slab --uring-sqpoll"; do
+    rm -rf $dir/dst
+    if ! timeout 120 $CP -r $opts $dir/src $dir/dst 2> $dir/err \
+       || ! diff -r $dir/src $dir/dst > /dev/null; then
+        echo "FAIL: cp -r $opts: $(head -1 $dir/err)"; fail=1
+    fi
+done
+
+rm -rf $dir/dst $dir/grow
+cp -r $dir/src/d1 $dir/grow
+(for i in $(seq 1 200); do head -c 100000 /dev/zero >> $dir/grow/f$i; done) &
+timeout 60 $CP -r $dir/grow $dir/dst
+wait
+for i in $(seq 1 200); do
+    if [ $(stat -c %s $dir/dst/f$i) -lt $(stat -c %s $dir/src/d1/f$i) ]; then
+        echo "FAIL: copy of growing f$i is short"; fail=1; break
+    fi
+done
+
+[ $fail -eq 0 ] && echo "PASS"
+exit $fail
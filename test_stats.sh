@@ -0,0 +1,33 @@
+#!/bin/bash
+# Check that --uring-stats counts each source on its own: two identical
+# trees copied by one command must report the same numbers, not a
+# running total, and the buffers of every engine, workers included.  Run from the directory holding cp_uring_multi.
+CP=${CP:-./cp_uring_multi}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+fail=0
+
+for t in a b; do
+    mkdir -p $dir/$t/sub
+    for i in $(seq 1 30); do echo "file $i" > $dir/$t/f$i; echo "$i" > $dir/$t/sub/g$i; done
+done
+
+for threads in 1 4; do
+    rm -rf $dir/dst
+    mkdir $dir/dst
+    timeout 60 $CP -r --uring-stats --threads=$threads $dir/a $dir/b $dir/dst 2> $dir/err
+    stats=$(grep -E 'files opened|pread/pwrite' $dir/err)
+    if [ $(echo "$stats" | wc -l) -ne 2 ] || [ $(echo "$stats" | sort -u | wc -l) -ne 1 ]; then
+        echo "FAIL: --threads=$threads, statistics differ between sources:"
+        echo "$stats"; fail=1
+    fi
+    engines=$(grep -c "buffers allocated by $((threads == 1 ? 1 : threads + 1)) engine" $dir/err)
+    if [ $engines -ne 2 ]; then
+        echo "FAIL: --threads=$threads, buffers not counted over every engine"; fail=1
+    fi
+    diff -r $dir/a $dir/dst/a > /dev/null && diff -r $dir/b $dir/dst/b > /dev/null \
+        || { echo "FAIL: --threads=$threads: copy differs"; fail=1; }
+done
+
+[ $fail -eq 0 ] && echo "PASS"
+exit $fail
@@ -0,0 +1,60 @@
+#!/bin/bash
+# Check recursive copies with directory walkers (--walkers): trees must
+# come out whole, directories the copy skips (here, ones whose
+# destination is a file) must not stall it, and with -x a mount point
+# must be copied empty.  The -x part needs root to mount a tmpfs.
+# Run from the directory holding cp_uring_multi.
+CP=${CP:-./cp_uring_multi}
+dir=$(mktemp -d)
+trap 'mountpoint -q $dir/src/mnt && umount $dir/src/mnt; rm -rf "$dir"' EXIT
+fail=0
+
+for a in $(seq 1 20); do
+    for b in a b skip; do
+        mkdir -p $dir/src/d$a/$b/c/e
+        for i in 1 2 3; do echo "$a $b $i" > $dir/src/d$a/$b/c/f$i; done
+    done
+done
+
+for walkers in 0 1 4 16; do
+    rm -rf $dir/dst
+    if ! timeout 60 $CP -r --walkers=$walkers $dir/src $dir/dst 2> $dir/err \
+       || ! diff -r $dir/src $dir/dst > /dev/null; then
+        echo "FAIL: cp -r --walkers=$walkers: $(head -1 $dir/err)"; fail=1
+    fi
+done
+
+# every skip/ directory collides with a file in the destination
+rm -rf $dir/dst
+mkdir $dir/dst
+for a in $(seq 1 20); do mkdir -p $dir/dst/d$a; touch $dir/dst/d$a/skip; done
+timeout 60 $CP -rT --walkers=4 $dir/src $dir/dst 2> $dir/err
+rc=$?
+if [ $rc -eq 124 ]; then
+    echo "FAIL: copy with skipped directories hung"; fail=1
+elif [ $rc -eq 0 ] || [ $(grep -c 'cannot overwrite non-directory' $dir/err) -ne 20 ]; then
+    echo "FAIL: skipped directories not reported (exit $rc)"; fail=1
+elif ! diff -r $dir/src/d7/a $dir/dst/d7/a > /dev/null; then
+    echo "FAIL: copy with skipped directories differs"; fail=1
+fi
+
+mkdir $dir/src/mnt
+if mount -t tmpfs tmpfs $dir/src/mnt 2> /dev/null; then
+    mkdir -p $dir/src/mnt/deep/er
+    echo hidden > $dir/src/mnt/deep/er/file
+    rm -rf $dir/dst
+    timeout 60 $CP -rx --walkers=4 $dir/src $dir/dst
+    if [ ! -d $dir/dst/mnt ] || [ -n "$(ls -A $dir/dst/mnt)" ]; then
+        echo "FAIL: cp -x crossed into a mount"; fail=1
+    fi
+    rm -rf $dir/dst
+    timeout 60 $CP -r --walkers=4 $dir/src $dir/dst
+    cmp -s $dir/src/mnt/deep/er/file $dir/dst/mnt/deep/er/file \
+        || { echo "FAIL: cp -r missed a mount"; fail=1; }
+    umount $dir/src/mnt
+else
+    echo "SKIP: -x (cannot mount a tmpfs)"
+fi
+
+[ $fail -eq 0 ] && echo "PASS"
+exit $fail
@@ -0,0 +1,46 @@
+#!/bin/bash
+# Check that preallocated (unwritten) extents come out allocated in the
+# copy, both for a file named on the command line and for one copied
+# within a tree, and become holes with --sparse=always.  Needs a file
+# system with unwritten extents (ext4, XFS) under TMPDIR, and filefrag.
+# Run from the directory holding cp_uring_multi.
+CP=${CP:-./cp_uring_multi}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+fail=0
+
+mkdir $dir/tree
+src=$dir/tree/prealloc
+if ! fallocate -l 256M $src 2> /dev/null \
+   || ! filefrag -v $src 2> /dev/null | grep -q unwritten; then
+    echo "SKIP: no unwritten extents under $dir"; exit 0
+fi
+# some data between preallocated ranges
+head -c 8M /dev/urandom | dd of=$src bs=1M seek=100 conv=notrunc status=none
+sync $src
+
+allocated () { echo $(( $(stat -c %b $1) * $(stat -c %B $1) )); }
+
+check () {
+    local dst=$1 what=$2
+    if ! cmp -s $src $dst; then
+        echo "FAIL: $what: contents differ"; fail=1
+    elif [ $(allocated $dst) -lt $(( 256 * 1024 * 1024 )) ]; then
+        echo "FAIL: $what: preallocated space became holes"; fail=1
+    elif ! filefrag -v $dst | grep -q unwritten; then
+        echo "FAIL: $what: zeros were written, not allocated"; fail=1
+    fi
+}
+
+timeout 60 $CP $src $dir/file && check $dir/file "command-line file"
+timeout 60 $CP -r $dir/tree $dir/copy && check $dir/copy/prealloc "file in a tree"
+timeout 60 $CP --threads=4 -r $dir/tree $dir/copy4 \
+    && check $dir/copy4/prealloc "file in a tree, 4 engines"
+
+timeout 60 $CP --sparse=always $src $dir/sparse
+if ! cmp -s $src $dir/sparse || [ $(allocated $dir/sparse) -gt $(( 16 * 1024 * 1024 )) ]; then
+    echo "FAIL: --sparse=always did not make holes"; fail=1
+fi
+
+[ $fail -eq 0 ] && echo "PASS"
+exit $fail
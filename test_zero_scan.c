@@ -0,0 +1,103 @@
+/* Check every zero_scan implementation the CPU supports against a plain
+   loop: buffers of zeros of many lengths and alignments, and the same
+   with one nonzero byte at each position, including the tails the
+   vector loops leave to is_nul.  Also check that ZERO_SCAN, when set,
+   picks the implementation.  Usage: test_zero_scan  */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "zero-scan.h"
+
+#define MAX_LEN 600
+#define MAX_SHIFT 64
+#define BIG_LEN (4 * 1024 * 1024)
+
+static bool check(const struct zero_scan_impl *impl, char *buf, size_t len)
+{
+    if (!impl->scan(buf, len)) {
+        printf("%s: zeros at +%zu, %zu bytes not seen as zero\n",
+               impl->name, (size_t)((uintptr_t)buf % MAX_SHIFT), len);
+        return false;
+    }
+    for (size_t i = 0; i < len; i++) {
+        // bytes with only the low or only the high bit set
+        buf[i] = i & 1 ? 0x80 : 0x01;
+        bool zero = impl->scan(buf, len);
+        buf[i] = 0;
+        if (zero) {
+            printf("%s: byte %zu of %zu at +%zu missed\n",
+                   impl->name, i, len, (size_t)((uintptr_t)buf % MAX_SHIFT));
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(void)
+{
+    char *buf = aligned_alloc(4096, BIG_LEN + MAX_SHIFT);
+    if (!buf)
+        return 1;
+    memset(buf, 0, BIG_LEN + MAX_SHIFT);
+    int fail = 0;
+
+    for (const struct zero_scan_impl *impl = zero_scan_impls; impl->name; impl++) {
+        if (!impl->supported()) {
+            printf("%-8s not supported\n", impl->name);
+            continue;
+        }
+        bool ok = true;
+        for (size_t shift = 0; ok && shift < MAX_SHIFT; shift++)
+            for (size_t len = 0; ok && len <= MAX_LEN; len++)
+                ok = check(impl, buf + shift, len);
+
+        // bytes just past the scanned length must not count
+        buf[100] = 1;
+        if (ok && !impl->scan(buf, 100)) {
+            printf("%s: read past the end\n", impl->name);
+            ok = false;
+        }
+        buf[100] = 0;
+
+        // large blocks, nonzero near the start, middle and end
+        size_t where[] = { 0, 4095, BIG_LEN / 2 + 17, BIG_LEN - 1 };
+        for (size_t i = 0; ok && i < sizeof where / sizeof *where; i++) {
+            buf[where[i]] = 1;
+            ok = !impl->scan(buf, BIG_LEN);
+            buf[where[i]] = 0;
+            if (!ok)
+                printf("%s: byte %zu of %d missed\n", impl->name, where[i], BIG_LEN);
+        }
+        if (ok && !impl->scan(buf, BIG_LEN)) {
+            printf("%s: %d zeros not seen as zero\n", impl->name, BIG_LEN);
+            ok = false;
+        }
+        printf("%-8s %s\n", impl->name, ok ? "ok" : "FAILED");
+        fail |= !ok;
+    }
+
+    // the forced implementation, if the CPU has it, else the default
+    const char *forced = getenv("ZERO_SCAN");
+    const struct zero_scan_impl *expect = zero_scan_impls;
+    while (!expect->supported())
+        expect++;
+    for (const struct zero_scan_impl *impl = zero_scan_impls; forced && impl->name; impl++)
+        if (impl->supported() && strcmp(impl->name, forced) == 0)
+            expect = impl;
+    if (strcmp(zero_scan_name(), expect->name) != 0) {
+        printf("zero_scan picked %s, expected %s\n", zero_scan_name(), expect->name);
+        fail = 1;
+    }
+    buf[7] = 1;
+    if (zero_scan(buf, 4096) || !zero_scan(buf + 8, 4096)) {
+        printf("zero_scan (%s) gave a wrong result\n", zero_scan_name());
+        fail = 1;
+    }
+    free(buf);
+    return fail;
+}
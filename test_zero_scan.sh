@@ -0,0 +1,31 @@
+#!/bin/bash
+# Check the zero_scan implementations and the ZERO_SCAN override with
+# test_zero_scan, then copy a file with holes under each of them.
+# Run from the directory holding test_zero_scan and cp_uring_multi.
+CP=${CP:-./cp_uring_multi}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+fail=0
+
+# zeros with a few bytes of data at unaligned offsets, and a hole
+head -c 64M /dev/zero > $dir/src
+for off in 1 4097 1048639 33554435 67108863; do
+    printf x | dd of=$dir/src bs=1 seek=$off conv=notrunc status=none
+done
+truncate -s 96M $dir/src
+
+for impl in "" avx512 avx2 sse2 generic unknown; do
+    if ! ZERO_SCAN=$impl ./test_zero_scan > $dir/out; then
+        echo "FAIL: test_zero_scan, ZERO_SCAN=$impl"; cat $dir/out; fail=1
+    fi
+    rm -f $dir/dst
+    ZERO_SCAN=$impl timeout 60 $CP --sparse=always $dir/src $dir/dst
+    if ! cmp -s $dir/src $dir/dst; then
+        echo "FAIL: cp --sparse=always, ZERO_SCAN=$impl: copy differs"; fail=1
+    elif [ $(( $(stat -c %b $dir/dst) * $(stat -c %B $dir/dst) )) -gt $(( 8 * 1024 * 1024 )) ]; then
+        echo "FAIL: cp --sparse=always, ZERO_SCAN=$impl: zeros not made holes"; fail=1
+    fi
+done
+
+[ $fail -eq 0 ] && echo "PASS"
+exit $fail
@@ -0,0 +1,419 @@
+/* tree-walk.c -- enumerate directory trees ahead of a recursive copy
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.  */
+
+/* copy_dir reads each directory with savedir and then copies its
+   entries one by one, so the copy engine idles while directories are
+   read and inodes are looked up.  Here a pool of walker threads reads
+   the directories of the tree ahead of the copy, in the order copy_dir
+   will ask for them, and stats every entry so that copy_internal finds
+   the inodes cached.  copy_dir takes each listing with walk_take; if no
+   walker got to the directory yet, it reads the directory itself.
+
+   Walkers stay at most WALK_MAX_AHEAD names ahead of the copy.  They
+   never follow symbolic links, so with -L the directories reached
+   through a link are read by copy_dir itself, and with -x they do not
+   enter other file systems.  Each node keeps the nodes queued for its
+   subdirectories; once copy_dir is done with a directory (walk_finish),
+   whatever it did not take below it, e.g. directories that failed to
+   copy, is dropped, so that it does not count against the limit.
+   The walkers live for one copy: walk_exit stops and joins them, and
+   drops every node left.  */
+
+#include <config.h>
+
+#include <pthread.h>
+#include <sys/types.h>
+#include "system.h"
+
+#include "filenamecat.h"
+#include "hash.h"
+#include "savedir.h"
+#include "xalloc.h"
+#include "tree-walk.h"
+
+/* Maximum number of names read but not yet taken by the copy.  */
+#define WALK_MAX_AHEAD (1024 * 1024)
+
+enum walk_state
+{
+  WALK_QUEUED,                  /* waiting on the stack */
+  WALK_RUNNING,                 /* being read */
+  WALK_DONE,                    /* listing ready for walk_take */
+  WALK_TAKEN                    /* listing taken, entries being copied */
+};
+
+struct walk_node
+{
+  char *dir;
+  enum walk_state state;
+  char *names;                  /* as returned by savedir */
+  size_t n_names;
+  int err;                      /* errno if savedir failed */
+  bool abandoned;               /* dropped while being read */
+  struct walk_node *up;         /* neighbours on the stack */
+  struct walk_node *down;
+  struct walk_node *parent;     /* the node that queued this one */
+  struct walk_node *child;      /* first of the nodes this one queued */
+  struct walk_node *prev;       /* siblings */
+  struct walk_node *next;
+};
+
+static pthread_mutex_t walk_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t walk_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t walk_done = PTHREAD_COND_INITIALIZER;
+
+/* Nodes by directory name, and the stack of queued ones.  */
+static Hash_table *walk_table;
+static struct walk_node *walk_top;
+static size_t walk_ahead;
+static size_t walk_threads;
+static pthread_t *walk_tids;
+static bool walk_stopping;
+static bool walk_one_file_system;
+
+static size_t
+walk_hash (void const *x, size_t table_size)
+{
+  struct walk_node const *node = x;
+  return hash_string (node->dir, table_size);
+}
+
+static bool
+walk_compare (void const *x, void const *y)
+{
+  struct walk_node const *a = x;
+  struct walk_node const *b = y;
+  return STREQ (a->dir, b->dir);
+}
+
+static struct walk_node *
+walk_lookup (char const *dir)
+{
+  struct walk_node key;
+  key.dir = (char *) dir;
+  return hash_lookup (walk_table, &key);
+}
+
+/* Create a node for DIR in state STATE.  DIR is taken over.
+   The caller holds walk_lock.  */
+static struct walk_node *
+walk_new (char *dir, enum walk_state state)
+{
+  struct walk_node *node = xzalloc (sizeof *node);
+  node->dir = dir;
+  node->state = state;
+  if (hash_insert (walk_table, node) == NULL)
+    xalloc_die ();
+  return node;
+}
+
+static void
+walk_push (struct walk_node *node)
+{
+  node->up = NULL;
+  node->down = walk_top;
+  if (walk_top)
+    walk_top->up = node;
+  walk_top = node;
+}
+
+static void
+walk_unlink (struct walk_node *node)
+{
+  if (node->up)
+    node->up->down = node->down;
+  else
+    walk_top = node->down;
+  if (node->down)
+    node->down->up = node->up;
+}
+
+static void
+walk_adopt (struct walk_node *parent, struct walk_node *node)
+{
+  node->parent = parent;
+  node->prev = NULL;
+  node->next = parent->child;
+  if (parent->child)
+    parent->child->prev = node;
+  parent->child = node;
+}
+
+static void
+walk_orphan (struct walk_node *node)
+{
+  if (node->parent == NULL)
+    return;
+  if (node->prev)
+    node->prev->next = node->next;
+  else
+    node->parent->child = node->next;
+  if (node->next)
+    node->next->prev = node->prev;
+  node->parent = NULL;
+}
+
+static void
+walk_free (struct walk_node *node)
+{
+  free (node->names);
+  free (node->dir);
+  free (node);
+}
+
+/* Drop NODE and the nodes below it.  A node being read is left to
+   walk_read to free.  The caller holds walk_lock.  */
+static void
+walk_prune (struct walk_node *node)
+{
+  while (node->child)
+    walk_prune (node->child);
+  walk_orphan (node);
+  hash_delete (walk_table, node);
+
+  if (node->state == WALK_RUNNING)
+    {
+      node->abandoned = true;
+      return;
+    }
+  if (node->state == WALK_QUEUED)
+    walk_unlink (node);
+  else if (node->state == WALK_DONE)
+    walk_ahead -= node->n_names;
+  walk_free (node);
+}
+
+/* Read NODE's directory and stat its entries, without holding
+   walk_lock.  Queue its subdirectories so that the first one is read
+   first, as copy_dir will ask for it first.  */
+static void
+walk_read (struct walk_node *node)
+{
+  char *names = savedir (node->dir, SAVEDIR_SORT_FASTREAD);
+  int err = errno;
+  size_t n_names = 0;
+  size_t n_subdirs = 0;
+  char **subdirs = NULL;
+
+  if (names)
+    {
+      int fd = open (node->dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+      struct stat dir_st;
+      if (0 <= fd && walk_one_file_system && fstat (fd, &dir_st) != 0)
+        {
+          close (fd);
+          fd = -1;
+        }
+      for (char *namep = names; *namep; namep += strlen (namep) + 1)
+        {
+          struct stat st;
+          n_names++;
+          if (0 <= fd
+              && fstatat (fd, namep, &st, AT_SYMLINK_NOFOLLOW) == 0
+              && S_ISDIR (st.st_mode)
+              && ! (walk_one_file_system && st.st_dev != dir_st.st_dev))
+            {
+              subdirs = xnrealloc (subdirs, n_subdirs + 1, sizeof *subdirs);
+              subdirs[n_subdirs++] = file_name_concat (node->dir, namep, NULL);
+            }
+        }
+      if (0 <= fd)
+        close (fd);
+    }
+
+  pthread_mutex_lock (&walk_lock);
+  if (node->abandoned)
+    {
+      pthread_mutex_unlock (&walk_lock);
+      while (n_subdirs)
+        free (subdirs[--n_subdirs]);
+      free (subdirs);
+      free (names);
+      walk_free (node);
+      return;
+    }
+  while (n_subdirs)
+    {
+      char *subdir = subdirs[--n_subdirs];
+      if (walk_lookup (subdir))
+        free (subdir);
+      else
+        {
+          struct walk_node *child = walk_new (subdir, WALK_QUEUED);
+          walk_adopt (node, child);
+          walk_push (child);
+        }
+    }
+  node->names = names;
+  node->n_names = n_names;
+  node->err = err;
+  node->state = WALK_DONE;
+  walk_ahead += n_names;
+  pthread_cond_broadcast (&walk_done);
+  pthread_cond_broadcast (&walk_work);
+  pthread_mutex_unlock (&walk_lock);
+  free (subdirs);
+}
+
+static void *
+walk_thread (void *arg _GL_UNUSED)
+{
+  pthread_mutex_lock (&walk_lock);
+  while (true)
+    {
+      while (! walk_stopping
+             && (walk_top == NULL || WALK_MAX_AHEAD <= walk_ahead))
+        pthread_cond_wait (&walk_work, &walk_lock);
+      if (walk_stopping)
+        break;
+
+      struct walk_node *node = walk_top;
+      walk_unlink (node);
+      node->state = WALK_RUNNING;
+      pthread_mutex_unlock (&walk_lock);
+      walk_read (node);
+      pthread_mutex_lock (&walk_lock);
+    }
+  pthread_mutex_unlock (&walk_lock);
+  return NULL;
+}
+
+/* Start N_THREADS walker threads, unless they are already running.
+   With no threads, walk_take reads directories itself.  Unless
+   ONE_FILE_SYSTEM is false, walkers do not enter directories on other
+   file systems than their parent, as cp -x does not.  */
+void
+walk_init (size_t n_threads, bool one_file_system)
+{
+  if (walk_table || n_threads == 0)
+    return;
+
+  walk_one_file_system = one_file_system;
+  walk_table = hash_initialize (1024, NULL, walk_hash, walk_compare, NULL);
+  if (walk_table == NULL)
+    xalloc_die ();
+
+  walk_tids = xnmalloc (n_threads, sizeof *walk_tids);
+  while (walk_threads < n_threads
+         && pthread_create (&walk_tids[walk_threads], NULL,
+                            walk_thread, NULL) == 0)
+    walk_threads++;
+}
+
+/* Stop the walker threads, wait for them to exit, and drop whatever
+   they read that the copy did not take.  */
+void
+walk_exit (void)
+{
+  if (walk_table == NULL)
+    return;
+
+  pthread_mutex_lock (&walk_lock);
+  walk_stopping = true;
+  pthread_cond_broadcast (&walk_work);
+  pthread_mutex_unlock (&walk_lock);
+  for (size_t i = 0; i < walk_threads; i++)
+    pthread_join (walk_tids[i], NULL);
+  free (walk_tids);
+  walk_tids = NULL;
+  walk_threads = 0;
+  walk_stopping = false;
+
+  /* No node is being read anymore.  */
+  size_t n = hash_get_n_entries (walk_table);
+  struct walk_node **nodes = xnmalloc (n, sizeof *nodes);
+  hash_get_entries (walk_table, (void **) nodes, n);
+  for (size_t i = 0; i < n; i++)
+    walk_free (nodes[i]);
+  free (nodes);
+  hash_free (walk_table);
+  walk_table = NULL;
+  walk_top = NULL;
+  walk_ahead = 0;
+}
+
+/* Return the names in directory DIR, as savedir would, and let the
+   walkers read its subdirectories.  The caller frees the result, and
+   calls walk_finish once done with the entries.
+   Return NULL and set errno if DIR cannot be read.  */
+char *
+walk_take (char const *dir)
+{
+  if (walk_threads == 0)
+    return savedir (dir, SAVEDIR_SORT_FASTREAD);
+
+  pthread_mutex_lock (&walk_lock);
+  struct walk_node *node = walk_lookup (dir);
+  bool read_here = true;
+  if (node && node->state == WALK_TAKEN)
+    {
+      /* Already being copied, under another name of the same
+         directory: read it again without the walkers.  */
+      pthread_mutex_unlock (&walk_lock);
+      return savedir (dir, SAVEDIR_SORT_FASTREAD);
+    }
+  if (node == NULL)
+    node = walk_new (xstrdup (dir), WALK_RUNNING);
+  else if (node->state == WALK_QUEUED)
+    {
+      walk_unlink (node);
+      node->state = WALK_RUNNING;
+    }
+  else
+    read_here = false;
+
+  if (read_here)
+    {
+      pthread_mutex_unlock (&walk_lock);
+      walk_read (node);
+      pthread_mutex_lock (&walk_lock);
+    }
+
+  while (node->state != WALK_DONE)
+    pthread_cond_wait (&walk_done, &walk_lock);
+
+  /* Keep the node, as the parent of its subdirectories', until
+     walk_finish.  */
+  char *names = node->names;
+  int err = node->err;
+  node->names = NULL;
+  node->state = WALK_TAKEN;
+  walk_ahead -= node->n_names;
+  if (names == NULL)
+    walk_prune (node);
+  pthread_cond_broadcast (&walk_work);
+  pthread_mutex_unlock (&walk_lock);
+
+  if (names == NULL)
+    errno = err;
+  return names;
+}
+
+/* Tell the walkers that the copy is done with the entries of DIR, as
+   returned by walk_take: drop whatever they read below DIR that the
+   copy did not take.  */
+void
+walk_finish (char const *dir)
+{
+  if (walk_threads == 0)
+    return;
+
+  pthread_mutex_lock (&walk_lock);
+  struct walk_node *node = walk_lookup (dir);
+  if (node && node->state == WALK_TAKEN)
+    walk_prune (node);
+  pthread_cond_broadcast (&walk_work);
+  pthread_mutex_unlock (&walk_lock);
+}
@@ -0,0 +1,38 @@
+/* tree-walk.h -- enumerate directory trees ahead of a recursive copy
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.  */
+
+#ifndef TREE_WALK_H
+# define TREE_WALK_H
+
+/* Start N_THREADS walker threads, which read directories ahead of the
+   copy and stat their entries, unless they are already running.  With
+   ONE_FILE_SYSTEM, they do not enter other file systems, as cp -x.  */
+void walk_init (size_t n_threads, bool one_file_system);
+
+/* Return the entries of directory DIR, a malloc'd sequence of
+   NUL-terminated names ending with an empty one, as savedir does;
+   read ahead by a walker if one got to DIR first.  Return NULL and set
+   errno on failure.  */
+char *walk_take (char const *dir);
+
+/* Declare that the copy is done with the entries of DIR, so that what
+   the walkers read below it and the copy skipped can be dropped.  */
+void walk_finish (char const *dir);
+
+/* Stop and join the walker threads, and free what they read ahead that
+   the copy never took.  The next walk_init starts them again.  */
+void walk_exit (void);
+
+#endif /* TREE_WALK_H */
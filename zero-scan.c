@@ -0,0 +1,185 @@
+/* zero-scan.c -- find out whether a buffer holds only zero bytes
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.  */
+
+/* With hole detection on, every block read is scanned for zeros before
+   it is written, and is_nul, which compares the buffer with itself
+   shifted by 16 bytes, runs well below memory bandwidth.  On x86 the
+   buffer is instead ORed together in vector registers, 4 vectors per
+   iteration, with the widest instruction set the CPU has, picked on
+   the first call.  Setting ZERO_SCAN in the environment to the name of
+   an implementation forces it, if the CPU supports it.  */
+
+#include <config.h>
+
+#include <sys/types.h>
+#include "system.h"
+
+#include "zero-scan.h"
+
+#if ((defined __x86_64__ || defined __i386__)                          \
+     && (4 < __GNUC__ || (__GNUC__ == 4 && 9 <= __GNUC_MINOR__)))
+# define ZERO_SCAN_X86 1
+# include <immintrin.h>
+#else
+# define ZERO_SCAN_X86 0
+#endif
+
+static bool
+zero_scan_generic (void const *buf, size_t length)
+{
+  return is_nul (buf, length);
+}
+
+static bool
+supported_always (void)
+{
+  return true;
+}
+
+#if ZERO_SCAN_X86
+
+/* Each scans LENGTH bytes from P in steps of four vectors, leaving the
+   tail to is_nul.  */
+
+static bool __attribute__ ((__target__ ("sse2")))
+zero_scan_sse2 (void const *buf, size_t length)
+{
+  char const *p = buf;
+  char const *end = p + length - length % 64;
+  __m128i const zero = _mm_setzero_si128 ();
+
+  for (; p < end; p += 64)
+    {
+      __m128i acc = _mm_or_si128 (
+        _mm_or_si128 (_mm_loadu_si128 ((__m128i const *) p),
+                      _mm_loadu_si128 ((__m128i const *) (p + 16))),
+        _mm_or_si128 (_mm_loadu_si128 ((__m128i const *) (p + 32)),
+                      _mm_loadu_si128 ((__m128i const *) (p + 48))));
+      if (_mm_movemask_epi8 (_mm_cmpeq_epi8 (acc, zero)) != 0xffff)
+        return false;
+    }
+  return is_nul (p, length % 64);
+}
+
+static bool __attribute__ ((__target__ ("avx2")))
+zero_scan_avx2 (void const *buf, size_t length)
+{
+  char const *p = buf;
+  char const *end = p + length - length % 128;
+
+  for (; p < end; p += 128)
+    {
+      __m256i acc = _mm256_or_si256 (
+        _mm256_or_si256 (_mm256_loadu_si256 ((__m256i const *) p),
+                         _mm256_loadu_si256 ((__m256i const *) (p + 32))),
+        _mm256_or_si256 (_mm256_loadu_si256 ((__m256i const *) (p + 64)),
+                         _mm256_loadu_si256 ((__m256i const *) (p + 96))));
+      if (! _mm256_testz_si256 (acc, acc))
+        return false;
+    }
+  return is_nul (p, length % 128);
+}
+
+static bool __attribute__ ((__target__ ("avx512f")))
+zero_scan_avx512 (void const *buf, size_t length)
+{
+  char const *p = buf;
+  char const *end = p + length - length % 256;
+
+  for (; p < end; p += 256)
+    {
+      __m512i acc = _mm512_or_si512 (
+        _mm512_or_si512 (_mm512_loadu_si512 (p),
+                         _mm512_loadu_si512 (p + 64)),
+        _mm512_or_si512 (_mm512_loadu_si512 (p + 128),
+                         _mm512_loadu_si512 (p + 192)));
+      if (_mm512_test_epi64_mask (acc, acc))
+        return false;
+    }
+  return is_nul (p, length % 256);
+}
+
+static bool
+supported_sse2 (void)
+{
+  __builtin_cpu_init ();
+  return __builtin_cpu_supports ("sse2");
+}
+
+static bool
+supported_avx2 (void)
+{
+  __builtin_cpu_init ();
+  return __builtin_cpu_supports ("avx2");
+}
+
+static bool
+supported_avx512 (void)
+{
+  __builtin_cpu_init ();
+  return __builtin_cpu_supports ("avx512f");
+}
+
+#endif /* ZERO_SCAN_X86 */
+
+/* From the most to the least preferred, ending with a null entry.  */
+struct zero_scan_impl const zero_scan_impls[] =
+{
+#if ZERO_SCAN_X86
+  { "avx512", zero_scan_avx512, supported_avx512 },
+  { "avx2", zero_scan_avx2, supported_avx2 },
+  { "sse2", zero_scan_sse2, supported_sse2 },
+#endif
+  { "generic", zero_scan_generic, supported_always },
+  { NULL, NULL, NULL }
+};
+
+static struct zero_scan_impl const *zero_scan_selected;
+
+static struct zero_scan_impl const *
+zero_scan_select (void)
+{
+  struct zero_scan_impl const *impl
+    = __atomic_load_n (&zero_scan_selected, __ATOMIC_RELAXED);
+  if (impl)
+    return impl;
+
+  char const *forced = getenv ("ZERO_SCAN");
+  for (impl = zero_scan_impls; impl->name; impl++)
+    if (impl->supported () && (! forced || STREQ (forced, impl->name)))
+      break;
+  if (! impl->name)
+    impl = &zero_scan_impls[0];
+  while (! impl->supported ())
+    impl++;
+
+  /* Threads racing here all store the same pointer.  */
+  __atomic_store_n (&zero_scan_selected, impl, __ATOMIC_RELAXED);
+  return impl;
+}
+
+/* Return true if the LENGTH bytes at BUF are all zero.  */
+bool
+zero_scan (void const *buf, size_t length)
+{
+  return zero_scan_select ()->scan (buf, length);
+}
+
+/* Return the name of the implementation zero_scan uses.  */
+char const *
+zero_scan_name (void)
+{
+  return zero_scan_select ()->name;
+}
@@ -0,0 +1,48 @@
+/* zero-scan.h -- find out whether a buffer holds only zero bytes
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.  */
+
+#ifndef ZERO_SCAN_H
+# define ZERO_SCAN_H
+
+/* Return true if the LENGTH bytes at BUF are all zero; BUF need not be
+   aligned.  The first call picks the first entry of zero_scan_impls
+   the CPU supports, or the one named by the ZERO_SCAN environment
+   variable if the CPU supports that, and all later calls, from any
+   thread, use the same one.  */
+bool zero_scan (void const *buf, size_t length);
+
+/* Return the name of the implementation zero_scan uses, making the
+   choice if zero_scan has not been called yet.  */
+char const *zero_scan_name (void);
+
+/* An implementation zero_scan may pick.  */
+struct zero_scan_impl
+{
+  /* The name ZERO_SCAN selects it by, e.g. "avx2" or "generic".  */
+  char const *name;
+
+  /* Same contract as zero_scan; call it only if supported is true.  */
+  bool (*scan) (void const *buf, size_t length);
+
+  /* Whether the CPU can run scan.  */
+  bool (*supported) (void);
+};
+
+/* The implementations built in, from the most to the least preferred,
+   ending with an entry whose name is NULL.  The last real entry,
+   "generic", is always supported.  For benchmarks and tests.  */
+extern struct zero_scan_impl const zero_scan_impls[];
+
+#endif /* ZERO_SCAN_H */